@@ -1,13 +1,23 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so lookups of different blocks
+// rarely contend. A miss recycles the unused buffer with the
+// oldest release timestamp from any bucket.
+//
+// The number of buffers is chosen at boot from the amount of
+// free memory, up to NBUF. Buffer headers and their data come
+// from slab caches.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritestart and later bwait to overlap several writes.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -22,70 +32,228 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 61
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
+// use at most 1/BCACHEFRAC of free memory for buffers.
+#define BCACHEFRAC 16
+
+struct bucket {
+  struct spinlock lock;
+  // Linked list of this bucket's buffers, through prev/next.
   struct buf head;
+};
+
+struct {
+  // serializes recycling, so that at most one process at a
+  // time holds two bucket locks. lookups don't take it.
+  struct spinlock lock;
+  int nbuf;
+  struct bucket bucket[NBUCKET];
+  int nhit;
+  int nmiss;
+  int nra;       // blocks read ahead
+  int nrahit;    // ... and later read by bread()
+  int nrawaste;  // ... and recycled without being read
 } bcache;
 
+struct kcache bufcache;   // struct buf
+struct kcache bdatacache; // BSIZE bytes of buffer data
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Insert b at the front of bucket bk. Caller holds bk->lock.
+static void
+binsert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Remove b from whatever bucket it is in.
+// Caller holds that bucket's lock.
+static void
+bremove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  kcacheinit(&bufcache, "buf", sizeof(struct buf));
+  kcacheinit(&bdatacache, "bdata", BSIZE);
+
+  for(i = 0; i < NBUCKET; i++){
+    bk = &bcache.bucket[i];
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  bcache.nbuf = kfreepages() / BCACHEFRAC * (PGSIZE / BSIZE);
+  if(bcache.nbuf > NBUF)
+    bcache.nbuf = NBUF;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Spread the buffers over the buckets. A data block
+  // never crosses a page, so the disk can DMA into it.
+  for(i = 0; i < bcache.nbuf; i++){
+    if((b = kcachealloc(&bufcache)) == 0 ||
+       (b->data = kcachealloc(&bdatacache)) == 0)
+      panic("binit");
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    binsert(&bcache.bucket[i % NBUCKET], b);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Number of buffers in the cache.
+int
+bcachesize(void)
+{
+  return bcache.nbuf;
+}
+
+// Look for block on device dev in bucket bk.
+// If found, take a reference and return it.
+// Caller holds bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+blookup(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, recycle a buffer for it.
+// In either case, return the buffer with a reference
+// taken but not locked, and set *cached if the block
+// was already in the cache.
+// Returns 0 if every buffer is in use.
+static struct buf*
+bfind(uint dev, uint blockno, int *cached)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct bucket *victimbk, *cur;
+  struct buf *b, *victim;
+
+  // Is the block already cached?
+  *cached = 1;
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  if(b)
+    __sync_fetch_and_add(&bcache.nhit, 1);
+  release(&bk->lock);
+  if(b)
+    return b;
+
+  // Not cached. Only one process recycles at a time; check
+  // again in case another one just brought the block in.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    return b;
+  }
+  *cached = 0;
 
-  // Not cached.
   // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Keep the lock of the bucket holding the best
+  // candidate so far, so that it stays unused.
+  victim = 0;
+  victimbk = 0;
+  for(cur = bcache.bucket; cur < bcache.bucket+NBUCKET; cur++){
+    acquire(&cur->lock);
+    int found = 0;
+    for(b = cur->head.next; b != &cur->head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->timestamp < victim->timestamp)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(victimbk)
+        release(&victimbk->lock);
+      victimbk = cur;
+    } else {
+      release(&cur->lock);
     }
   }
-  panic("bget: no buffers");
+  if(victim == 0){
+    release(&bcache.lock);
+    return 0;
+  }
+
+  bremove(victim);
+  release(&victimbk->lock);
+
+  if(victim->readahead){
+    // read ahead but never used.
+    victim->readahead = 0;
+    bcache.nrawaste++;
+  }
+
+  acquire(&bk->lock);
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  binsert(bk, victim);
+  bcache.nmiss++;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  return victim;
+}
+
+// Return a locked buffer for block on device dev.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+  int cached;
+
+  if((b = bfind(dev, blockno, &cached)) == 0)
+    panic("bget: no buffers");
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Drop a reference taken by bfind(), and stamp the
+// buffer with the release time for LRU recycling.
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    b->timestamp = ticks;
+  }
+  release(&bk->lock);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -99,9 +267,67 @@ bread(uint dev, uint blockno)
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
+  if(b->readahead){
+    b->readahead = 0;
+    __sync_fetch_and_add(&bcache.nrahit, 1);
+  }
+  return b;
+}
+
+// Return a locked buf for a block that the caller is about
+// to overwrite completely, without reading it from disk.
+struct buf*
+bgetnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
   return b;
 }
 
+// Start reading block on device dev into the cache, if
+// it isn't there already, and return without waiting.
+// The buffer stays locked until the read finishes, when
+// virtio_disk_intr() calls breadahead_done().
+// Gives up quietly if every buffer is in use.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  int cached;
+
+  if((b = bfind(dev, blockno, &cached)) == 0)
+    return;
+  if(cached){
+    bunref(b);
+    return;
+  }
+  acquiresleep(&b->lock);
+  if(b->valid){
+    // another process read it while we waited for the lock.
+    releasesleep(&b->lock);
+    bunref(b);
+    return;
+  }
+  b->readahead = 1;
+  b->async = 1;
+  __sync_fetch_and_add(&bcache.nra, 1);
+  virtio_disk_start(b, 0);
+}
+
+// Called by virtio_disk_intr() when a read started by
+// breadahead() completes: the block is now valid, and
+// the buffer is unlocked for whoever reads it.
+void
+breadahead_done(struct buf *b)
+{
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bunref(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +337,28 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk and return without
+// waiting, so that many writes can be in flight at once.
+// Must be locked; call bwait() before brelse().
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for a write started by bwritestart() to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Stamp it with the release time for LRU recycling.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +366,44 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bunref(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Report hit/miss counts and bucket lock contention
+// for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  int n = 0, nts = 0, nacq = 0;
 
+  n += statslock(&bcache.lock, buf+n, sz-n);
+  for(int i = 0; i < NBUCKET; i++){
+    nts += bcache.bucket[i].lock.nts;
+    nacq += bcache.bucket[i].lock.n;
+  }
+  n += snprintf(buf+n, sz-n, "lock: bcache.bucket x%d: #test-and-set %d #acquire() %d\n",
+                NBUCKET, nts, nacq);
+  n += snprintf(buf+n, sz-n, "bcache: buffers %d hit %d miss %d\n",
+                bcache.nbuf, bcache.nhit, bcache.nmiss);
+  n += snprintf(buf+n, sz-n, "readahead: issued %d hit %d wasted %d\n",
+                bcache.nra, bcache.nrahit, bcache.nrawaste);
+  return n;
+}
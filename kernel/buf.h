@@ -1,12 +1,15 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // release buf when the disk finishes (readahead)
+  int readahead; // read ahead, and not yet used by bread()
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint timestamp;   // ticks at last release, for LRU recycling
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes, from kalloc()
 };
 
@@ -2,20 +2,30 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kcache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bgetnew(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
+void            breadahead_done(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachesize(void);
+int             bcachestats(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -50,6 +60,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -62,15 +73,28 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_pages(int);
+void*           kalloc_pages_try(int);
+void            kfree_pages(void*, int);
+void*           kalloc_zeroed(void);
+void*           kalloc_pagetable(void);
+int             kzerofill(void);
+void            ksplit(void*, int);
 void            kinit(void);
+int             kfreepages(void);
+int             kallocstats(char*, int);
+void            krefinc(void*);
+int             krefcnt(void*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+int             logstats(char*, int);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -81,6 +105,12 @@ void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
@@ -95,15 +125,18 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedslice(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            idlekick(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             schedstats(char*, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -115,6 +148,13 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             statslock(struct spinlock*, char*, int);
+
+// slab.c
+void            kcacheinit(struct kcache*, char*, uint);
+void*           kcachealloc(struct kcache*);
+void            kcachefree(struct kcache*, void*);
+int             kcachestats(char*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -139,12 +179,24 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timersinit(void);
+void            timeradd(struct timer*, int, void (*)(void*), void*);
+int             timerdel(struct timer*);
+int             timersleep(int);
+void            timertick(void);
+int             timernext(uint*);
+int             timerstats(char*, int);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            clockidle(void);
+void            clockresume(void);
+void            clockkick(int);
 
 // uart.c
 void            uartinit(void);
@@ -156,6 +208,10 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmsetuser(pagetable_t, pagetable_t);
+void            kvmfree(pagetable_t);
+int             uvmkshare(pagetable_t);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
@@ -164,24 +220,49 @@ void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             cowcopy(pagetable_t, uint64);
+int             vmfault(pagetable_t, uint64, int);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// ucopy.S
+int             ucopy(void*, void*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+int             vmaadd(struct vma*, uint64, uint64, struct inode*, uint, uint, int, int);
+struct vma*     vmalookup(struct vma*, uint64);
+struct vma*     vmaoverlap(struct vma*, uint64, uint64);
+void            vmaclear(struct vma*);
+void            vmadup(struct vma*, struct vma*);
+int             vmafill(pagetable_t, struct vma*, uint64);
+void            vmaprefault(uint64, int);
+uint64          vmaplace(struct vma*, uint64, uint64);
+int             vmaunmap(pagetable_t, struct vma*, struct vma*, uint64, uint64);
+void            vmaunmapall(pagetable_t, struct vma*);
+int             vmapopulate(pagetable_t, struct vma*);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+int             virtiostats(char*, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -7,8 +7,9 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
+// Program segments are not read in here. exec() records
+// each one as a file-backed vma, and vmfault() reads a
+// page from the file the first time the program touches it.
 int
 exec(char *path, char **argv)
 {
@@ -18,9 +19,11 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -38,7 +41,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each program segment comes from.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,14 +51,16 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // segments must be in address order, in user memory.
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > MAXUVA)
+      goto bad;
+    if(vmaadd(vma, ph.vaddr, ph.vaddr + ph.memsz, ip, ph.off, ph.filesz,
+              PTE_W|PTE_X|PTE_R|PTE_U, 0) < 0)
       goto bad;
+    idup(ip);
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -68,6 +73,8 @@ exec(char *path, char **argv)
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
   uint64 sz1;
+  if(sz + 2*PGSIZE > MAXUVA)
+    goto bad;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   sz = sz1;
@@ -114,7 +121,12 @@ exec(char *path, char **argv)
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  kvmsetuser(p->kpagetable, pagetable);
+  sfence_vma();
+  vmaunmapall(oldpagetable, p->vma);
   proc_freepagetable(oldpagetable, oldsz);
+  vmaclear(p->vma);
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,33 +137,6 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  vmaclear(vma);
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -12,17 +12,23 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from filecache; ftable.lock
+// protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+struct kcache filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kcacheinit(&filecache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +37,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcachealloc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,10 +73,13 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kcachefree(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.type == FD_DEVICE && devsw[ff.major].close)
+      devsw[ff.major].close(&ff);
     begin_op();
     iput(ff.ip);
     end_op();
@@ -101,6 +105,42 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Before a read of n bytes at f->off, start reading ahead
+// if f is being read sequentially. The window doubles on
+// each sequential read, up to MAXRA blocks, and halves on
+// a seek; more blocks are requested once fewer than half a
+// window remain ahead of the reader, so that the disk
+// works on them while the caller uses the ones it has.
+// Caller holds f->ip->lock.
+static void
+filereadahead(struct file *f, int n)
+{
+  uint last, start;
+
+  if(n <= 0)
+    return;
+  if(f->off == f->ranext){
+    if(f->rawin == 0)
+      f->rawin = MINRA;
+    else if(f->rawin < MAXRA)
+      f->rawin = f->rawin*2 > MAXRA ? MAXRA : f->rawin*2;
+  } else {
+    // random access.
+    f->rawin /= 2;
+    f->raend = 0;
+  }
+  if(f->rawin == 0)
+    return;
+
+  // first block after the ones this read needs.
+  last = (f->off + n - 1) / BSIZE + 1;
+  start = f->raend > last ? f->raend : last;
+  if(start - last >= f->rawin / 2)
+    return; // still far enough ahead.
+  readahead(f->ip, start, last + f->rawin - start);
+  f->raend = last + f->rawin;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -116,11 +156,13 @@ fileread(struct file *f, uint64 addr, int n)
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    filereadahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -5,8 +5,14 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint off;          // FD_INODE, and FD_DEVICE for the device's use
   short major;       // FD_DEVICE
+  void *priv;        // FD_DEVICE: the device's state for this open file
+
+  // FD_INODE sequential readahead; see fileread().
+  uint ranext;       // off after the last read
+  uint rawin;        // readahead window, in blocks
+  uint raend;        // first block not yet read ahead
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -18,6 +24,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // Next in icache hash chain
+  struct inode *lnext; // icache unused list, while ref is 0
+  struct inode *lprev;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -31,10 +40,12 @@ struct inode {
 
 // map major device number to device functions.
 struct devsw {
-  int (*read)(int, uint64, int);
+  int (*read)(struct file*, int, uint64, int);
   int (*write)(int, uint64, int);
+  void (*close)(struct file*); // may be 0
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
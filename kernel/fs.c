@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -162,29 +163,72 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// In-memory inodes come from inodecache when iget() first
+// needs one. When iput() drops the last reference, the inode
+// stays cached, on the icache unused list, so that looking
+// the file up again soon doesn't read the inode block; the
+// list keeps the NICACHE most recently used, and the older
+// ones go back to inodecache. Each cached inode is in the
+// icache hash table, on the chain its (dev, inum) hashes to.
+//
+// The icache.lock spin-lock protects the hash table, the
+// unused list, and the allocation of icache entries. Since ip->ref indicates whether
+// an entry is in use, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold icache.lock while using
+// any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // linked through ip->hnext
+  // inodes with ref 0, most recently used first, linked
+  // through ip->lnext and ip->lprev.
+  struct inode unused;
+  int nunused;
 } icache;
 
+struct kcache inodecache;
+
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  kcacheinit(&inodecache, "inode", sizeof(struct inode));
+  icache.unused.lnext = &icache.unused;
+  icache.unused.lprev = &icache.unused;
+}
+
+// Take ip off the unused list. Caller holds icache.lock.
+static void
+iunused_remove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  icache.nunused--;
+}
+
+// Take ip out of the hash table and free it.
+// Caller holds icache.lock.
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp = ihash(ip->dev, ip->inum);
+
+  while(*pp != ip)
+    pp = &(*pp)->hnext;
+  *pp = ip->hnext;
+  kcachefree(&inodecache, ip);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -242,31 +286,32 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **h;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  h = ihash(dev, inum);
+  for(ip = *h; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        iunused_remove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate an inode cache entry.
+  if((ip = kcachealloc(&inodecache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = *h;
+  *h = ip;
   release(&icache.lock);
 
   return ip;
@@ -323,8 +368,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the unused list, to be reused by iget() or recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -354,6 +399,23 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    if(ip->valid == 0){
+      // nothing worth keeping: never read, or just freed.
+      ifree(ip);
+    } else {
+      ip->lnext = icache.unused.lnext;
+      ip->lprev = &icache.unused;
+      ip->lnext->lprev = ip;
+      icache.unused.lnext = ip;
+      if(++icache.nunused > NICACHE){
+        // recycle the least recently used.
+        struct inode *old = icache.unused.lprev;
+        iunused_remove(old);
+        ifree(old);
+      }
+    }
+  }
   release(&icache.lock);
 }
 
@@ -475,6 +537,20 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading blocks [bn, bn+n) of ip's data into the
+// buffer cache without waiting, stopping at end of file.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint bn, uint n)
+{
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE;
+
+  // blocks below ip->size are always allocated,
+  // so bmap() won't allocate here.
+  for(; n > 0 && bn < nblocks; bn++, n--)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
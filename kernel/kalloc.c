@@ -1,6 +1,29 @@
 // Physical memory allocator, for user processes,
-// kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// kernel stacks, page-table pages, pipe buffers
+// and the slab caches.
+//
+// Free memory belongs to a buddy allocator: a free block of
+// order k is 2^k contiguous pages, aligned to its size, on the
+// free list for order k. kalloc_pages(k) splits a larger block
+// when no block of order k is free, and freeing a block merges
+// it with its buddy, the other half of the enclosing block of
+// order k+1, whenever the buddy is free as well.
+//
+// Most allocations are single pages, so each CPU keeps a free
+// list of pages of its own, and kalloc() and kfree() on
+// different harts don't contend. A CPU moves pages between its
+// list and the buddy allocator NBATCH at a time, and when both
+// are empty it steals a batch of pages from another CPU's list.
+//
+// Every page also has a reference count, so that
+// copy-on-write fork can share pages between page tables.
+// A page goes back on a free list only when kfree() drops
+// its last reference. A block of several pages has a single
+// reference count, that of its first page.
+//
+// Harts with nothing to run keep a reserve of pages zeroed
+// ahead of time, for kalloc_zeroed() and kalloc_pagetable();
+// see kzerofill().
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +32,23 @@
 #include "riscv.h"
 #include "defs.h"
 
+// max pages moved from another CPU's list per steal.
+#define NSTEAL 32
+
+#define MAXORDER 10   // largest buddy block: 2^MAXORDER pages
+#define KCPUMAX 64    // free pages a CPU keeps on its own list
+#define NBATCH 16     // pages moved to or from the buddy allocator at once
+#define ZHIGH 128     // pages kzerofill() keeps zeroed
+#define ZLOW 32       // below this, wake an idle hart to zero more
+
+// Fill freed and newly allocated pages with junk, to catch
+// dangling references; but not in a PERF build.
+#ifdef PERF
+#define JUNK(pa, c, n)
+#else
+#define JUNK(pa, c, n) memset((pa), (c), (n))
+#endif
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,17 +56,73 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // buddy free lists only
 };
 
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;      // pages on freelist
+  int nsteal;     // successful steals by this CPU
+  int nstolen;    // pages other CPUs took from this list
+} kmem[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct run head[MAXORDER+1]; // circular lists of free blocks
+  int nblock[MAXORDER+1];      // free blocks of each order
+  int nsplit;
+  int nmerge;
+} buddy;
+
+#define NPAGE ((PHYSTOP-KERNBASE)/PGSIZE)
+#define PGNUM(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PGADDR(i) ((struct run*)(KERNBASE + (uint64)(i)*PGSIZE))
+
+// reference count of each physical page, indexed by PGNUM().
+// updated with atomic instructions rather than under a lock.
+static int pageref[NPAGE];
+
+// k+1 if the page starts a free buddy block of order k,
+// otherwise 0. buddy.lock protects it.
+static uchar freeorder[NPAGE];
+
+// what a zeroed page is for, for the hit counts.
+enum { ZPAGETABLE, ZDATA, NZUSE };
+
+// pages zeroed ahead of time. They count as allocated, with a
+// reference each, until kalloc_zeroed() or kalloc_pagetable()
+// hands them out, but kalloc() takes them when there's
+// nothing else left.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  int kicked;        // woke an idle hart since the last refill
+  int nzeroed;       // pages zeroed by kzerofill()
+  int nkick;         // idle harts woken to zero pages
+  int nhit[NZUSE];   // allocations the reserve served
+  int nmiss[NZUSE];  // ... and that found it empty
+} zpool;
+
+static char *zusenames[NZUSE] = { "pagetable", "data" };
+
+static char *kmemnames[NCPU] = {
+  "kmem0", "kmem1", "kmem2", "kmem3",
+  "kmem4", "kmem5", "kmem6", "kmem7",
+};
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, kmemnames[i]);
+  initlock(&buddy.lock, "buddy");
+  initlock(&zpool.lock, "zpool");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.head[k].next = buddy.head[k].prev = &buddy.head[k];
+  // all pages start out on the booting CPU's list, and
+  // drain from there into the buddy allocator.
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +131,283 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    pageref[PGNUM(p)] = 1;
     kfree(p);
+  }
+}
+
+// Put block r on the free list for order k.
+// Caller must hold buddy.lock.
+static void
+blistadd(int k, struct run *r)
+{
+  r->next = buddy.head[k].next;
+  r->prev = &buddy.head[k];
+  r->next->prev = r;
+  buddy.head[k].next = r;
+  buddy.nblock[k]++;
+  freeorder[PGNUM(r)] = k+1;
+}
+
+// Take block r off the free list for order k.
+// Caller must hold buddy.lock.
+static void
+blistdel(int k, struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  buddy.nblock[k]--;
+  freeorder[PGNUM(r)] = 0;
+}
+
+// Give the block of order k at pa to the buddy allocator,
+// merging it with its buddy as long as that is free.
+// Caller must hold buddy.lock.
+static void
+bfree(void *pa, int k)
+{
+  uint64 i = PGNUM(pa), b;
+
+  for(; k < MAXORDER; k++){
+    b = i ^ (1UL << k);
+    if(b >= NPAGE || freeorder[b] != k+1)
+      break;
+    blistdel(k, PGADDR(b));
+    i &= ~(1UL << k);
+    buddy.nmerge++;
+  }
+  blistadd(k, PGADDR(i));
+}
+
+// Take a free block of order k, splitting a larger one
+// if need be. Returns 0 if there is none.
+// Caller must hold buddy.lock.
+static struct run*
+balloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(buddy.head[j].next != &buddy.head[j])
+      break;
+  if(j > MAXORDER)
+    return 0;
+  r = buddy.head[j].next;
+  blistdel(j, r);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    blistadd(j, (struct run*)((char*)r + (PGSIZE << j)));
+    buddy.nsplit++;
+  }
+  return r;
+}
+
+// Give a chain of single pages, linked through next,
+// to the buddy allocator.
+static void
+bfreechain(struct run *r)
+{
+  struct run *next;
+
+  acquire(&buddy.lock);
+  for(; r; r = next){
+    next = r->next;
+    bfree(r, 0);
+  }
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *drain;
+  int id, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  ref = __sync_sub_and_fetch(&pageref[PGNUM(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
+  JUNK(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
+  drain = 0;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > KCPUMAX){
+    // too many; return a batch to the buddy allocator.
+    drain = r;
+    for(int i = 1; i < NBATCH; i++)
+      r = r->next;
+    kmem[id].freelist = r->next;
+    kmem[id].nfree -= NBATCH;
+    r->next = 0;
+  }
+  release(&kmem[id].lock);
+  pop_off();
+
+  if(drain)
+    bfreechain(drain);
+}
+
+// Move up to NBATCH pages from the buddy allocator to
+// CPU id's list. Returns the number of pages moved.
+static int
+refill(int id)
+{
+  struct run *head, *r;
+  int n;
+
+  head = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < NBATCH && (r = balloc(0)) != 0; n++){
+    r->next = head;
+    head = r;
+  }
+  release(&buddy.lock);
+  if(n == 0)
+    return 0;
+
+  acquire(&kmem[id].lock);
+  for(r = head; r->next; r = r->next)
+    ;
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = head;
+  kmem[id].nfree += n;
+  release(&kmem[id].lock);
+  return n;
+}
+
+// Move up to NSTEAL pages from some other CPU's free
+// list to CPU id's list. Only one kmem lock is held at
+// a time, so concurrent steals can't deadlock.
+// Returns the number of pages moved.
+static int
+steal(int id)
+{
+  struct run *head, *tail;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    int victim = (id + i) % NCPU;
+
+    acquire(&kmem[victim].lock);
+    head = tail = kmem[victim].freelist;
+    if(head == 0){
+      release(&kmem[victim].lock);
+      continue;
+    }
+    // take up to half of the victim's pages.
+    n = 1;
+    while(n < NSTEAL && n < kmem[victim].nfree/2 && tail->next){
+      tail = tail->next;
+      n++;
+    }
+    kmem[victim].freelist = tail->next;
+    kmem[victim].nfree -= n;
+    kmem[victim].nstolen += n;
+    release(&kmem[victim].lock);
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+    acquire(&kmem[id].lock);
+    tail->next = kmem[id].freelist;
+    kmem[id].freelist = head;
+    kmem[id].nfree += n;
+    kmem[id].nsteal++;
+    release(&kmem[id].lock);
+    return n;
+  }
+  return 0;
+}
+
+// Take a page from the reserve of zeroed pages, or return 0.
+// use is ZPAGETABLE or ZDATA, or -1 to count nothing and
+// leave the reserve run down.
+static void *
+zpoolget(int use)
+{
+  struct run *r;
+  int kick = 0;
+
+  acquire(&zpool.lock);
+  r = zpool.list;
+  if(r){
+    zpool.list = r->next;
+    zpool.n--;
+    r->next = 0;
+  }
+  if(use >= 0){
+    if(r)
+      zpool.nhit[use]++;
+    else
+      zpool.nmiss[use]++;
+    if(zpool.n < ZLOW && !zpool.kicked){
+      // harts in tickless idle won't look at the
+      // reserve until something wakes them.
+      zpool.kicked = kick = 1;
+      zpool.nkick++;
+    }
+  }
+  release(&zpool.lock);
+  if(kick)
+    idlekick();
+  return (void*)r;
+}
+
+// Allocate a page of zeroes for use: one from the reserve
+// if there is one, else a new page zeroed now.
+static void *
+zalloc(int use)
+{
+  void *pa;
+
+  if((pa = zpoolget(use)) != 0)
+    return pa;
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Take a page from this CPU's free list, refilling it if need
+// be. Returns 0 if there is no free page, not counting the
+// reserve of zeroed pages.
+static struct run*
+kallocfree(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  for(;;){
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+    if(r){
+      kmem[id].freelist = r->next;
+      kmem[id].nfree--;
+    }
+    release(&kmem[id].lock);
+    if(r || (refill(id) == 0 && steal(id) == 0))
+      break;
+  }
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +418,244 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = kallocfree()) != 0){
+    JUNK((char*)r, 5, PGSIZE);
+    pageref[PGNUM(r)] = 1;
+  } else {
+    r = zpoolget(-1); // last resort: a zeroed page
+  }
+  return (void*)r;
+}
+
+// Allocate a page of zeroes for user memory or kernel
+// data. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  return zalloc(ZDATA);
+}
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+// Allocate an empty page-table page.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pagetable(void)
+{
+  return zalloc(ZPAGETABLE);
+}
+
+// Zero a page for the reserve, if it isn't full. This is
+// the idle-time zeroing task: scheduler() calls it when
+// there's nothing to run, a page at a time so that it
+// looks for processes to run in between, and idles only
+// once the reserve is full.
+// Returns 1 if it zeroed a page, 0 if there was no need
+// or no free memory.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(zpool.n >= ZHIGH)
+    return 0;
+  // not kalloc(), which would take the page from the reserve
+  // when memory is short.
+  if((r = kallocfree()) == 0)
+    return 0;
+  pageref[PGNUM(r)] = 1;
+  memset(r, 0, PGSIZE);
+  acquire(&zpool.lock);
+  r->next = zpool.list;
+  zpool.list = r;
+  zpool.n++;
+  zpool.nzeroed++;
+  zpool.kicked = 0;
+  release(&zpool.lock);
+  return 1;
+}
+
+// Give every CPU's free pages, and the zeroed pages, back
+// to the buddy allocator, so that they can merge into
+// larger blocks.
+static void
+kflush(void)
+{
+  struct run *r;
+
+  while((r = zpoolget(-1)) != 0)
+    kfree(r);
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    r = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    bfreechain(r);
+  }
+}
+
+// Allocate 2^order pages from the buddy allocator; if it
+// has no such block and flush is set, kflush() and retry.
+// The pages are zeroed if zero is set, else junk-filled.
+static void *
+kallocblock(int order, int flush, int zero)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return zero ? kalloc_zeroed() : kalloc();
+
+  acquire(&buddy.lock);
+  r = balloc(order);
+  release(&buddy.lock);
+  if(r == 0 && flush){
+    // maybe the CPUs' lists hold the missing pieces.
+    kflush();
+    acquire(&buddy.lock);
+    r = balloc(order);
+    release(&buddy.lock);
+  }
+
+  if(r){
+    if(zero)
+      memset(r, 0, PGSIZE << order);
+    else
+      JUNK((char*)r, 5, PGSIZE << order);
+    pageref[PGNUM(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Free them with kfree_pages(pa, order).
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  return kallocblock(order, 1, 0);
+}
+
+// Like kalloc_pages(), but zeroed, and for callers that can
+// do without the block: gives up if the buddy allocator has
+// none ready, rather than emptying the CPUs' free lists and
+// the zeroed pages into it to look for one.
+void *
+kalloc_pages_try(int order)
+{
+  return kallocblock(order, 0, 1);
+}
+
+// Drop a reference to the 2^order pages at pa, which
+// kalloc_pages(order) returned, and free them if it
+// was the last.
+void
+kfree_pages(void *pa, int order)
+{
+  int ref;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  ref = __sync_sub_and_fetch(&pageref[PGNUM(pa)], 1);
+  if(ref < 0)
+    panic("kfree_pages: ref");
+  if(ref > 0)
+    return;
+
+  JUNK(pa, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  bfree(pa, order);
+  release(&buddy.lock);
+}
+
+// Turn the 2^order pages at pa, which kalloc_pages(order)
+// returned, into separate pages that kfree() frees one at
+// a time. Each gets the block's reference count.
+void
+ksplit(void *pa, int order)
+{
+  int ref = pageref[PGNUM(pa)];
+
+  for(int i = 1; i < (1 << order); i++)
+    pageref[PGNUM(pa) + i] = ref;
+}
+
+// Return the number of free pages.
+int
+kfreepages(void)
+{
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    n += kmem[i].nfree;
+    release(&kmem[i].lock);
+  }
+  acquire(&buddy.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    n += buddy.nblock[k] << k;
+  release(&buddy.lock);
+  return n + zpool.n;
+}
+
+// Add a reference to an allocated page, for sharing it
+// between page tables.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&pageref[PGNUM(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return pageref[PGNUM(pa)];
+}
+
+// Report per-CPU free list sizes, steal counts, lock
+// contention, and the buddy allocator's free blocks of each
+// order, for the statistics device. frag is the percentage
+// of the buddy allocator's free pages that are not in blocks
+// of the largest order.
+int
+kallocstats(char *buf, int sz)
+{
+  int n = 0, nfree = 0, frag = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    n += statslock(&kmem[i].lock, buf+n, sz-n);
+    n += snprintf(buf+n, sz-n, "kmem%d: free %d steals %d stolen %d\n",
+                  i, kmem[i].nfree, kmem[i].nsteal, kmem[i].nstolen);
+  }
+
+  n += statslock(&buddy.lock, buf+n, sz-n);
+  for(int k = 0; k <= MAXORDER; k++)
+    nfree += buddy.nblock[k] << k;
+  if(nfree > 0)
+    frag = 100 - 100 * (buddy.nblock[MAXORDER] << MAXORDER) / nfree;
+  n += snprintf(buf+n, sz-n, "buddy: free %d frag %d%% splits %d merges %d\n",
+                nfree, frag, buddy.nsplit, buddy.nmerge);
+  n += snprintf(buf+n, sz-n, "buddy: blocks by order");
+  for(int k = 0; k <= MAXORDER; k++)
+    n += snprintf(buf+n, sz-n, " %d", buddy.nblock[k]);
+  n += snprintf(buf+n, sz-n, "\n");
+  n += statslock(&zpool.lock, buf+n, sz-n);
+  n += snprintf(buf+n, sz-n, "zpool: reserve %d low %d high %d zeroed %d kicks %d\n",
+                zpool.n, ZLOW, ZHIGH, zpool.nzeroed, zpool.nkick);
+  for(int u = 0; u < NZUSE; u++)
+    n += snprintf(buf+n, sz-n, "zpool: %s hit %d miss %d\n",
+                  zusenames[u], zpool.nhit[u], zpool.nmiss[u]);
+  return n;
+}
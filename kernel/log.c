@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when
+// there are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,7 +19,28 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until a commit finishes.
+//
+// Group commit: the last end_op() of a transaction closes
+// it and commits it. While the commit is being written,
+// new FS system calls join the next transaction, which is
+// committed as soon as the current commit is done (or by
+// its own last end_op(), if that comes later). The longer
+// a commit takes, the more system calls share the next one.
+//
+// To keep the next transaction from changing blocks that
+// are still being committed, the committer holds the
+// sleep-locks of all of its blocks until they are written
+// to their home locations; a system call that needs one of
+// them waits in bread(). The committer takes those locks
+// before any system call of the next transaction starts,
+// and needs no other locks while holding them, so it can't
+// deadlock with a system call holding one block and
+// waiting for another.
+//
+// Log blocks and home-location writes are queued to the
+// disk in batches and waited for together, rather than
+// one synchronous write at a time.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +49,10 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+
+// max log blocks being written at once, bounding the
+// extra buffers a commit needs.
+#define LOGBATCH 16
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -40,16 +64,24 @@ struct logheader {
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks of the on-disk log in use, header included.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a commit is in progress.
+  int closing;     // commit() is locking the closed transaction's blocks; wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+  struct logheader clh; // the transaction being committed.
+  struct buf *cbuf[LOGSIZE]; // clh's blocks, locked by commit().
+
+  // statistics.
+  int nop;         // FS system calls
+  int ncommit;     // commits
+  int nblocks;     // blocks committed
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,8 +91,19 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
   log.dev = dev;
+
+  // use as much of the on-disk log as the buffer cache can
+  // hold pinned: the committing and the open transaction
+  // pin their blocks, and everything else needs buffers too.
+  log.size = sb->nlog;
+  if(log.size > LOGSIZE)
+    log.size = LOGSIZE;
+  if(log.size > bcachesize() / 2)
+    log.size = bcachesize() / 2;
+  if(log.size - 1 < MAXOPBLOCKS)
+    panic("initlog: log too small");
+
   recover_from_log();
 }
 
@@ -75,7 +118,6 @@ install_trans(void)
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
     brelse(lbuf);
     brelse(dbuf);
   }
@@ -88,6 +130,8 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
+  if(lh->n < 0 || lh->n > LOGSIZE)
+    panic("read_head");
   log.lh.n = lh->n;
   for (i = 0; i < log.lh.n; i++) {
     log.lh.block[i] = lh->block[i];
@@ -95,18 +139,18 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write in-memory log header lh to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,7 +162,7 @@ recover_from_log(void)
   read_head();
   install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -127,13 +171,16 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.clh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size - 1){
+      // this op might exhaust log space, or pin more
+      // blocks in the cache than the log holds;
+      // wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.nop++;
       release(&log.lock);
       break;
     }
@@ -141,7 +188,8 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and no commit is already in progress.
 void
 end_op(void)
 {
@@ -149,9 +197,7 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -166,39 +212,91 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the committing transaction's blocks from the cache
+// to the log, LOGBATCH writes at a time.
 static void
 write_log(void)
+{
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.clh.n; tail += n) {
+    n = log.clh.n - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bgetnew(log.dev, log.start+tail+i+1); // log block
+      memmove(to[i]->data, log.cbuf[tail+i]->data, BSIZE);
+      bwritestart(to[i]);
+    }
+    for (i = 0; i < n; i++) {
+      bwait(to[i]);
+      brelse(to[i]);
+    }
+  }
+}
+
+// Write the committing transaction's blocks to their home
+// locations, all at once, then unpin and unlock them.
+static void
+install_commit(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwritestart(log.cbuf[tail]);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    bwait(log.cbuf[tail]);
+    bunpin(log.cbuf[tail]);
+    brelse(log.cbuf[tail]);
   }
 }
 
+// Close the open transaction and write it to disk, then do
+// the same for the transaction that filled up meanwhile, until
+// one is still in use by system calls or nothing is left.
+// Called with log.committing set, and no system calls
+// outstanding in the open transaction.
 static void
-commit()
+commit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  struct logheader lh;
+  int i;
+
+  acquire(&log.lock);
+  while(log.outstanding == 0 && log.lh.n > 0){
+    // close the transaction. keep new system calls out
+    // until its blocks are locked; they are pinned, so
+    // bread() finds them in the cache.
+    log.closing = 1;
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    release(&log.lock);
+    for (i = 0; i < log.clh.n; i++)
+      log.cbuf[i] = bread(log.dev, log.clh.block[i]);
+
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log();          // Write modified blocks from cache to log
+    write_head(&log.clh); // Write header to disk -- the real commit
+    install_commit();     // Now install writes to home locations
+    lh.n = 0;
+    write_head(&lh);      // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.ncommit++;
+    log.nblocks += log.clh.n;
+    log.clh.n = 0;
+    wakeup(&log);
   }
+  log.committing = 0;
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -215,12 +313,12 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  acquire(&log.lock);
+  if (log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  acquire(&log.lock);
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
@@ -233,3 +331,15 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// Report transaction and commit counts for the
+// statistics device.
+int
+logstats(char *buf, int sz)
+{
+  int n = 0;
+
+  n += statslock(&log.lock, buf+n, sz-n);
+  n += snprintf(buf+n, sz-n, "log: size %d ops %d commits %d blocks %d\n",
+                log.size, log.nop, log.ncommit, log.nblocks);
+  return n;
+}
@@ -47,6 +47,11 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// with paging on, the kernel reaches the devices above
+// PHYSTOP, out of the way of user memory: the registers
+// at physical address pa are at virtual address KDEV(pa).
+#define KDEV(pa) (PHYSTOP + (uint64)(pa))
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -62,6 +67,12 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   MAXUVA (user memory ends below it)
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// each process's kernel page table maps its user memory
+// in the place of the user page table, below the kernel.
+#define MAXUVA KERNBASE
@@ -1,13 +1,18 @@
-#define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NPRIO         3  // scheduling priority levels
+#define BOOSTTICKS   10  // ticks between scheduling priority boosts
+#define NOFILE       64  // open files per process; at most 64
+#define NVMA         16  // program segments and mmap()s per process
+#define NICACHE      50  // unreferenced i-nodes kept in memory
 #define NDEV         10  // maximum major device number
+#define PIPEPAGES     4  // pages of buffer per pipe; a power of two
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MINRA         2  // initial readahead window, in blocks
+#define MAXRA         8  // max readahead window, in blocks
+#define LOGSIZE      (MAXOPBLOCKS*12) // max blocks in on-disk log
+#define NBUF         1024  // max size of disk block cache
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define TICKCYCLES   1000000 // timer interval; about 1/10th second in qemu
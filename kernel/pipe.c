@@ -7,29 +7,60 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// The buffer is PIPEPAGES separately allocated pages.
+// Reads and writes copy a page-sized chunk at a time; a
+// chunk never crosses a page, so it never crosses the end
+// of the ring either. PIPESIZE must be a power of two so
+// that nread and nwrite can wrap around.
+#define PIPESIZE (PIPEPAGES*PGSIZE)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEPAGES];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+struct kcache pipecache;
+
+void
+pipeinit(void)
+{
+  kcacheinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < PIPEPAGES; i++)
+    if(pi->page[i])
+      kfree(pi->page[i]);
+  kcachefree(&pipecache, pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *pi;
+  int i;
 
   pi = 0;
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kcachealloc(&pipecache)) == 0)
     goto bad;
+  for(i = 0; i < PIPEPAGES; i++)
+    pi->page[i] = 0;
+  for(i = 0; i < PIPEPAGES; i++)
+    if((pi->page[i] = kalloc()) == 0)
+      goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -47,7 +78,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +99,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
@@ -76,12 +107,12 @@ pipeclose(struct pipe *pi, int writable)
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
-  char ch;
+  int i, m;
+  uint off;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
+  for(i = 0; i < n; i += m){
     while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
         release(&pi->lock);
@@ -90,9 +121,19 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    // copy as much as there is room for, up to the
+    // end of the page holding the write position.
+    off = pi->nwrite % PIPESIZE;
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PGSIZE - off % PGSIZE);
+    if(copyin(pr->pagetable, pi->page[off / PGSIZE] + off % PGSIZE, addr + i, m) == -1){
+      // a bad address: fail if it's the first byte, else
+      // report what was copied.
+      if(i == 0)
+        i = -1;
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    }
+    pi->nwrite += m;
   }
   wakeup(&pi->nread);
   release(&pi->lock);
@@ -102,9 +143,9 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
+  uint off;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -114,12 +155,21 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    // copy what has been written, up to the end of
+    // the page holding the read position.
+    off = pi->nread % PIPESIZE;
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PGSIZE - off % PGSIZE);
+    if(copyout(pr->pagetable, addr + i, pi->page[off / PGSIZE] + off % PGSIZE, m) == -1){
+      // as in pipewrite().
+      if(i == 0)
+        i = -1;
       break;
+    }
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
@@ -12,8 +12,8 @@ void
 plicinit(void)
 {
   // set desired IRQ priorities non-zero (otherwise disabled).
-  *(uint32*)(PLIC + UART0_IRQ*4) = 1;
-  *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
+  *(uint32*)KDEV(PLIC + UART0_IRQ*4) = 1;
+  *(uint32*)KDEV(PLIC + VIRTIO0_IRQ*4) = 1;
 }
 
 void
@@ -22,10 +22,10 @@ plicinithart(void)
   int hart = cpuid();
   
   // set uart's enable bit for this hart's S-mode. 
-  *(uint32*)PLIC_SENABLE(hart)= (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
+  *(uint32*)KDEV(PLIC_SENABLE(hart))= (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
 
   // set this hart's S-mode priority threshold to 0.
-  *(uint32*)PLIC_SPRIORITY(hart) = 0;
+  *(uint32*)KDEV(PLIC_SPRIORITY(hart)) = 0;
 }
 
 // ask the PLIC what interrupt we should serve.
@@ -33,7 +33,7 @@ int
 plic_claim(void)
 {
   int hart = cpuid();
-  int irq = *(uint32*)PLIC_SCLAIM(hart);
+  int irq = *(uint32*)KDEV(PLIC_SCLAIM(hart));
   return irq;
 }
 
@@ -42,5 +42,5 @@ void
 plic_complete(int irq)
 {
   int hart = cpuid();
-  *(uint32*)PLIC_SCLAIM(hart) = irq;
+  *(uint32*)KDEV(PLIC_SCLAIM(hart)) = irq;
 }
@@ -4,43 +4,97 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "slab.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
-
 struct proc *initproc;
 
+// Procs come from proccache as fork() needs them, up to one
+// per PROCFRAC pages of free memory at boot. Every allocated
+// proc is on the procs list, for kill() and procdump().
+// Lock order: procs.lock, then p->lock.
+#define PROCFRAC 64
+
+struct kcache proccache;
+
+struct {
+  struct spinlock lock;
+  struct proc *head;   // linked through p->next
+  int nproc;           // procs on the list
+  int maxproc;
+  int nkstack;         // kernel stack slots handed out
+} procs;
+
+// Per-CPU run queues of RUNNABLE processes. A process is on
+// at most one queue, and only while it is RUNNABLE and no
+// hart has picked it yet. Each hart runs processes from its
+// own queue, and steals from other harts' queues when its
+// own is empty, so choosing a process takes no scan of all processes.
+// Lock order: p->lock, then a run queue lock.
+//
+// Scheduling is a multi-level feedback queue: each run queue
+// has a FIFO per priority, and the highest non-empty one is
+// served first. A process that uses up its time slice (1<<prio
+// ticks) drops a level, one that sleeps first keeps its level,
+// and every BOOSTTICKS ticks everything goes back to the top,
+// so CPU-bound processes can't starve. See schedslice().
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO]; // linked through p->rqnext
+  struct proc *tail[NPRIO];
+  uint epoch;          // boost period when the queues were last boosted
+  int n;               // processes on the queue
+  int idle;            // hart is in tickless idle; see idle()
+  int nrun;            // processes this hart has run
+  int nsteal;          // ... of which taken from other queues
+  int nidle;           // times this hart went idle
+} runq[NCPU];
+
+static char *runqnames[NCPU] = {
+  "runq0", "runq1", "runq2", "runq3",
+  "runq4", "runq5", "runq6", "runq7",
+};
+
+// Sleep queues. A sleeping process is on the list of the
+// queue its channel hashes to, so wakeup() looks only at
+// processes sleeping on channels with the same hash.
+// Lock order: the lock passed to sleep(), p->lock, then a
+// sleep queue lock.
+#define NSLEEPQ 61
+#define NWAKE 16     // processes wakeup() takes off a queue at a time
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;   // linked through p->sqnext
+} sleepq[NSLEEPQ];
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
+static void makerunnable(struct proc *p);
+static uint boostepoch(void);
+static void childpush(struct proc **head, struct proc *c);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 // initialize the proc table at boot time.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      char *pa = kalloc();
-      if(pa == 0)
-        panic("kalloc");
-      uint64 va = KSTACK((int) (p - proc));
-      kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      p->kstack = va;
-  }
+  initlock(&procs.lock, "procs");
+  kcacheinit(&proccache, "proc", sizeof(struct proc));
+  procs.maxproc = kfreepages() / PROCFRAC;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, runqnames[i]);
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   kvminithart();
 }
 
@@ -85,31 +139,88 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Give a new proc its lock and a kernel stack, which it
+// keeps when it is freed and reused. The stack is mapped
+// high in memory, below an invalid guard page, in a slot
+// that no hart has touched before, so no TLB holds a stale
+// entry for it.
+static int
+procsetup(struct proc *p)
+{
+  char *pa;
+  uint64 va;
+
+  initlock(&p->lock, "proc");
+  if((pa = kalloc()) == 0)
+    return -1;
+  acquire(&procs.lock);
+  va = KSTACK(procs.nkstack);
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0){
+    release(&procs.lock);
+    kfree(pa);
+    return -1;
+  }
+  procs.nkstack++;
+  release(&procs.lock);
+  p->kstack = va;
+  return 0;
+}
+
+// Take p off the procs list and give it back to proccache.
+// p->lock must not be held.
+static void
+procfree(struct proc *p)
+{
+  acquire(&procs.lock);
+  *p->pprev = p->next;
+  if(p->next)
+    p->next->pprev = p->pprev;
+  procs.nproc--;
+  release(&procs.lock);
+  kcachefree(&proccache, p);
+}
+
+// Allocate an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If there are too many procs, or a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  if((p = kcachealloc(&proccache)) == 0)
+    return 0;
+  if(p->kstack == 0 && procsetup(p) < 0){
+    kcachefree(&proccache, p);
+    return 0;
   }
-  return 0;
 
-found:
+  acquire(&procs.lock);
+  if(procs.nproc >= procs.maxproc){
+    release(&procs.lock);
+    kcachefree(&proccache, p);
+    return 0;
+  }
+  p->next = procs.head;
+  if(p->next)
+    p->next->pprev = &p->next;
+  p->pprev = &procs.head;
+  procs.head = p;
+  procs.nproc++;
+  release(&procs.lock);
+
+  acquire(&p->lock);
   p->pid = allocpid();
+  p->cpu = cpuid();
+  p->prio = 0;
+  p->epoch = boostepoch();
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
+    procfree(p);
     return 0;
   }
 
@@ -118,6 +229,15 @@ found:
   if(p->pagetable == 0){
     freeproc(p);
     release(&p->lock);
+    procfree(p);
+    return 0;
+  }
+
+  // A kernel page table that maps the user memory too.
+  if((p->kpagetable = kvmcreate(p->pagetable)) == 0){
+    freeproc(p);
+    release(&p->lock);
+    procfree(p);
     return 0;
   }
 
@@ -130,21 +250,30 @@ found:
   return p;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// free the data hanging from a proc structure,
+// including user pages, and mark it UNUSED.
+// p->lock must be held. The caller then calls
+// procfree() to free the structure itself.
 static void
 freeproc(struct proc *p)
 {
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->kpagetable)
+    kvmfree(p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
   p->pid = 0;
+  p->fdmap = 0;
   p->parent = 0;
+  p->children = 0;
+  p->zombies = 0;
+  p->sibling = 0;
+  p->psibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -182,6 +311,15 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // the page-table pages that the process's kernel
+  // page table will share.
+  if(uvmkshare(pagetable) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -228,24 +366,27 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  makerunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address range; vmfault()
+// maps a zeroed page when the process first touches it.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // the heap mustn't run into mmap()ed memory.
+    if(sz + n > MAXUVA || vmaoverlap(p->vma, PGROUNDUP(sz), PGROUNDUP(sz + n)))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -262,6 +403,11 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // parent and child must share every page of a MAP_SHARED
+  // mapping, so fill them now; filling may sleep.
+  if(vmapopulate(p->pagetable, p->vma) < 0)
+    return -1;
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
@@ -271,11 +417,16 @@ fork(void)
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
+    procfree(np);
     return -1;
   }
   np->sz = p->sz;
-
-  np->parent = p;
+  if(vmacopy(p->pagetable, np->pagetable, p->vma) < 0){
+    freeproc(np);
+    release(&np->lock);
+    procfree(np);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -287,42 +438,82 @@ fork(void)
   for(i = 0; i < NOFILE; i++)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
+  np->fdmap = p->fdmap;
   np->cwd = idup(p->cwd);
 
+  // the child fills pages the parent hasn't touched yet
+  // from the same files.
+  vmadup(np->vma, p->vma);
+
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  // taking the parent's lock while holding np's goes against
+  // the parent-then-child order, but nobody can be waiting
+  // for np's lock while holding p's: np isn't on any list yet.
+  acquire(&p->lock);
+  np->parent = p;
+  childpush(&p->children, np);
+  release(&p->lock);
+
+  makerunnable(np);
 
   release(&np->lock);
 
   return pid;
 }
 
-// Pass p's abandoned children to init.
-// Caller must hold p->lock.
+// Each process keeps lists of its live children and of its
+// children that have exited but not been waited for, linked
+// through c->sibling. The parent's p->lock protects both.
+
+// Push child c onto list *head.
+static void
+childpush(struct proc **head, struct proc *c)
+{
+  c->sibling = *head;
+  if(c->sibling)
+    c->sibling->psibling = &c->sibling;
+  c->psibling = head;
+  *head = c;
+}
+
+// Take child c off whichever list it is on.
+static void
+childunlink(struct proc *c)
+{
+  *c->psibling = c->sibling;
+  if(c->sibling)
+    c->sibling->psibling = c->psibling;
+  c->sibling = 0;
+  c->psibling = 0;
+}
+
+// Move each child on list *from to init's list *to.
+static void
+childmove(struct proc **from, struct proc **to)
+{
+  struct proc *c;
+
+  while((c = *from) != 0){
+    childunlink(c);
+    acquire(&c->lock);
+    c->parent = initproc;
+    release(&c->lock);
+    childpush(to, c);
+  }
+}
+
+// Pass p's abandoned children, live and zombie, to init.
+// Caller must hold initproc->lock and p->lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
-    }
+  childmove(&p->children, &initproc->children);
+  if(p->zombies){
+    childmove(&p->zombies, &initproc->zombies);
+    wakeup1(initproc);
   }
 }
 
@@ -345,47 +536,52 @@ exit(int status)
       p->ofile[fd] = 0;
     }
   }
+  p->fdmap = 0;
 
   begin_op();
   iput(p->cwd);
   end_op();
   p->cwd = 0;
 
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
-  acquire(&initproc->lock);
-  wakeup1(initproc);
-  release(&initproc->lock);
+  vmaunmapall(p->pagetable, p->vma);
+  vmaclear(p->vma);
 
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
+  // Give any children to init. init is an ancestor of
+  // every process, so by the parent-then-child rule its
+  // lock comes before ours.
+  acquire(&initproc->lock);
   acquire(&p->lock);
-  struct proc *original_parent = p->parent;
+  reparent(p);
   release(&p->lock);
-  
-  // we need the parent's lock in order to wake it up from wait().
-  // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
+  release(&initproc->lock);
 
-  acquire(&p->lock);
+  // we need the parent's lock in order to move to its zombie
+  // list and wake it up from wait(). the parent-then-child rule
+  // says we have to lock it first. our parent may give us away
+  // to init while we wait for its lock, so check and retry.
+  struct proc *parent;
+  for(;;){
+    acquire(&p->lock);
+    parent = p->parent;
+    release(&p->lock);
+    acquire(&parent->lock);
+    acquire(&p->lock);
+    if(p->parent == parent)
+      break;
+    release(&p->lock);
+    release(&parent->lock);
+  }
 
-  // Give any children to init.
-  reparent(p);
+  childunlink(p);
+  childpush(&parent->zombies, p);
 
   // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  wakeup1(parent);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  release(&parent->lock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -398,7 +594,7 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int pid;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -406,37 +602,26 @@ wait(uint64 addr)
   acquire(&p->lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);
-          release(&np->lock);
-          release(&p->lock);
-          return pid;
-        }
+    // Any exited children?
+    if((np = p->zombies) != 0){
+      acquire(&np->lock);
+      pid = np->pid;
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                              sizeof(np->xstate)) < 0) {
         release(&np->lock);
+        release(&p->lock);
+        return -1;
       }
+      childunlink(np);
+      freeproc(np);
+      release(&np->lock);
+      release(&p->lock);
+      procfree(np);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(p->children == 0 || p->killed){
       release(&p->lock);
       return -1;
     }
@@ -446,6 +631,203 @@ wait(uint64 addr)
   }
 }
 
+// Priority boosts happen every BOOSTTICKS ticks, lazily: each
+// process and run queue notes the boost period it last saw.
+static uint
+boostepoch(void)
+{
+  return ticks / BOOSTTICKS;
+}
+
+// Move p to the top priority if a boost has happened since
+// it last looked. Caller must hold p->lock.
+static void
+boost(struct proc *p)
+{
+  uint e = boostepoch();
+
+  if(p->epoch != e){
+    p->epoch = e;
+    p->prio = 0;
+  }
+}
+
+// Mark p RUNNABLE and append it to the run queue of the
+// CPU it last ran on, which likely still caches its data,
+// unless that CPU is busy and another is idle. An idle
+// CPU doesn't take timer ticks, so wake it up. So does a
+// CPU running something of lower priority, so that it
+// preempts that process right away.
+// Caller must hold p->lock.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *rq;
+  struct proc *cur;
+  int id = p->cpu, kick;
+
+  if(!holding(&p->lock))
+    panic("makerunnable");
+  p->state = RUNNABLE;
+  boost(p);
+  if(!runq[id].idle){
+    for(int i = 0; i < NCPU; i++){
+      if(runq[i].idle){
+        id = i;
+        break;
+      }
+    }
+  }
+  rq = &runq[id];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->n++;
+  kick = rq->idle;
+  release(&rq->lock);
+  // racy peek at what the CPU is running; at worst it takes
+  // a needless timer interrupt, or preempts a tick late.
+  cur = cpus[id].proc;
+  if(cur && cur != p && cur->prio > p->prio)
+    kick = 1;
+  if(kick)
+    clockkick(id);
+}
+
+// Remove and return the first process of the highest
+// priority in rq, or 0 if rq is empty.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p;
+  int l;
+
+  if(rq->n == 0)
+    return 0;  // racy peek, to avoid locking empty queues.
+  acquire(&rq->lock);
+  if(rq->epoch != boostepoch()){
+    // boost: move every level to the end of the top one.
+    // the processes' own prio follows when they run.
+    rq->epoch = boostepoch();
+    for(l = 1; l < NPRIO; l++){
+      if(rq->head[l] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rqnext = rq->head[l];
+      else
+        rq->head[0] = rq->head[l];
+      rq->tail[0] = rq->tail[l];
+      rq->head[l] = rq->tail[l] = 0;
+    }
+  }
+  p = 0;
+  for(l = 0; l < NPRIO; l++){
+    if((p = rq->head[l]) != 0){
+      rq->head[l] = p->rqnext;
+      if(rq->head[l] == 0)
+        rq->tail[l] = 0;
+      p->rqnext = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Called on each timer interrupt in the current process.
+// Returns 1 if it should yield: because it has used up its
+// time slice, in which case it drops a priority level, or
+// because a process of higher priority is waiting on this
+// CPU's run queue.
+int
+schedslice(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq;
+  int l, yield = 0;
+
+  acquire(&p->lock);
+  boost(p);
+  if(ticks - p->slicestart >= (1 << p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    yield = 1;
+  } else {
+    rq = &runq[p->cpu];
+    for(l = 0; l < p->prio; l++)
+      if(rq->head[l])  // racy peek
+        yield = 1;
+  }
+  release(&p->lock);
+  return yield;
+}
+
+// Take a process from another CPU's run queue for CPU id,
+// or return 0 if all of them are empty.
+static struct proc*
+steal(int id)
+{
+  struct proc *p;
+
+  for(int i = 1; i < NCPU; i++){
+    if((p = runqpop(&runq[(id + i) % NCPU])) != 0){
+      runq[id].nsteal++;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Wait in wfi for something to run on CPU id, with the
+// periodic timer off (tickless idle). makerunnable()
+// kicks the CPU when it queues a process here.
+static void
+idle(int id)
+{
+  struct runq *rq = &runq[id];
+
+  // with interrupts off, an interrupt that arrives from
+  // here on stays pending and still ends the wfi.
+  intr_off();
+  clockidle();
+  acquire(&rq->lock);
+  if(rq->n > 0){
+    // queued since scheduler() looked.
+    release(&rq->lock);
+    clockresume();
+    return;
+  }
+  rq->idle = 1;
+  rq->nidle++;
+  release(&rq->lock);
+
+  asm volatile("wfi");
+
+  acquire(&rq->lock);
+  rq->idle = 0;
+  release(&rq->lock);
+  clockresume();
+}
+
+// Wake a hart in tickless idle, if there is one, to run
+// scheduler()'s loop again: kalloc.c wants its reserve of
+// zeroed pages filled.
+void
+idlekick(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    if(runq[i].idle){
+      clockkick(i);
+      return;
+    }
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -458,35 +840,45 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      intr_on();
-      asm volatile("wfi");
+
+    if((p = runqpop(&runq[id])) == 0 && (p = steal(id)) == 0){
+      // nothing to run: zero a page for kalloc_zeroed()
+      // and look again, or wait if there's none to zero.
+      if(kzerofill() == 0)
+        idle(id);
+      continue;
     }
+
+    // p may still be switching out on the hart that put
+    // it on the queue; acquire() waits until it's done.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    boost(p);
+    p->slicestart = ticks;
+    c->proc = p;
+    runq[id].nrun++;
+    w_satp(MAKE_SATP(p->kpagetable));
+    sfence_vma();
+    swtch(&c->context, &p->context);
+    kvminithart();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -523,7 +915,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  makerunnable(p);
   sched();
   release(&p->lock);
 }
@@ -549,31 +941,68 @@ forkret(void)
   usertrapret();
 }
 
+static struct sleepq*
+sqhash(void *chan)
+{
+  return &sleepq[((uint64)chan / sizeof(uint64)) % NSLEEPQ];
+}
+
+// Remove p from sq's list, if it is still there.
+// Caller must hold sq->lock.
+static void
+sqremove(struct sleepq *sq, struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &sq->head; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      break;
+    }
+  }
+  p->sqnext = 0;
+  p->sq = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = sqhash(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // Once we are on chan's sleep queue and hold
+  // p->lock, we can be guaranteed that we won't
+  // miss any wakeup (wakeup finds us on the queue
+  // and then locks p->lock), so it's okay to release lk.
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
+  }
+  acquire(&sq->lock);
+  p->chan = chan;
+  p->sq = sq;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
+  if(lk != &p->lock){
     release(lk);
   }
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() takes us off the queue, but
+  // kill() and wakeup1() don't.
+  if(p->sq){
+    acquire(&sq->lock);
+    sqremove(sq, p);
+    release(&sq->lock);
+  }
   p->chan = 0;
 
   // Reacquire original lock.
@@ -588,15 +1017,39 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *sq = sqhash(chan);
+  struct proc *woken[NWAKE];
+  struct proc *p, **pp;
+  int i, n;
+
+  // take chan's sleepers off the queue, NWAKE at a time;
+  // lock each one only after releasing sq->lock, to keep
+  // the lock order.
+  do {
+    n = 0;
+    acquire(&sq->lock);
+    pp = &sq->head;
+    while((p = *pp) != 0 && n < NWAKE){
+      if(p->chan == chan){
+        *pp = p->sqnext;
+        p->sqnext = 0;
+        p->sq = 0;
+        woken[n++] = p;
+      } else {
+        pp = &p->sqnext;
+      }
+    }
+    release(&sq->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+    for(i = 0; i < n; i++){
+      p = woken[i];
+      acquire(&p->lock);
+      if(p->state == SLEEPING && p->chan == chan) {
+        makerunnable(p);
+      }
+      release(&p->lock);
     }
-    release(&p->lock);
-  }
+  } while(n == NWAKE);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -607,7 +1060,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    makerunnable(p);
   }
 }
 
@@ -619,19 +1072,22 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  acquire(&procs.lock);
+  for(p = procs.head; p; p = p->next){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        makerunnable(p);
       }
       release(&p->lock);
+      release(&procs.lock);
       return 0;
     }
     release(&p->lock);
   }
+  release(&procs.lock);
   return -1;
 }
 
@@ -682,14 +1138,38 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = procs.head; p; p = p->next){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s prio %d", p->pid, state, p->name, p->prio);
     printf("\n");
   }
 }
+
+// Report run queue lengths, dispatch counts and sleep
+// queue lock contention for the statistics device.
+int
+schedstats(char *buf, int sz)
+{
+  int n = 0, nts = 0, nacq = 0;
+
+  for(int i = 0; i < NSLEEPQ; i++){
+    nts += sleepq[i].lock.nts;
+    nacq += sleepq[i].lock.n;
+  }
+  n += snprintf(buf+n, sz-n, "lock: sleepq x%d: #test-and-set %d #acquire() %d\n",
+                NSLEEPQ, nts, nacq);
+  n += snprintf(buf+n, sz-n, "procs: %d max %d\n", procs.nproc, procs.maxproc);
+  for(int i = 0; i < NCPU; i++){
+    if(runq[i].nrun == 0)
+      continue;  // hart not started.
+    n += statslock(&runq[i].lock, buf+n, sz-n);
+    n += snprintf(buf+n, sz-n, "runq%d: queued %d run %d stolen %d idle %d\n",
+                  i, runq[i].n, runq[i].nrun, runq[i].nsteal, runq[i].nidle);
+  }
+  return n;
+}
@@ -80,6 +80,20 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A range of user memory whose pages are read from a file,
+// or zeroed, on first touch: a program segment, or a
+// mapping made by mmap(); see vma.c.
+struct vma {
+  int used;                    // Is this slot in use?
+  uint64 start;                // First address, page-aligned
+  uint64 end;                  // One past the last address
+  struct inode *ip;            // File holding the contents, or 0
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes of file data; the rest is zero
+  int perm;                    // PTE permission bits for the pages
+  int flags;                   // MAP_SHARED or MAP_PRIVATE for mmap(), else 0
+};
+
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -89,18 +103,42 @@ struct proc {
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
+  struct proc *children;       // Live children
+  struct proc *zombies;        // Exited children, for wait()
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU it last ran on; its run queue
+  int prio;                    // Scheduling priority; 0 is highest
+  uint slicestart;             // ticks when its time slice began
+  uint epoch;                  // Boost period prio was last set in
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next process on the run queue
+
+  // the parent's p->lock must be held when using these:
+  struct proc *sibling;        // Next on the parent's children or zombies
+  struct proc **psibling;      // Link pointing at this process
+
+  // the sleep queue's lock must be held when using these:
+  struct sleepq *sq;           // Sleep queue p is on, if any
+  struct proc *sqnext;         // Next process on the sleep queue
+
+  // procs.lock must be held when using these:
+  struct proc *next;           // Next on the list of all processes
+  struct proc **pprev;         // Link pointing at this process
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, mapping user memory too
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  uint64 fdmap;                // Bit fd set if ofile[fd] is in use
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed areas of user memory
   char name[16];               // Process name (debugging)
 };
@@ -41,6 +41,7 @@ w_mepc(uint64 x)
 // Supervisor Status Register, sstatus
 
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User pages
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
@@ -248,6 +249,19 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+// counters that mcounteren and scounteren can make
+// readable in the mode below.
+#define COUNTEREN_CY (1L << 0) // cycle
+#define COUNTEREN_TM (1L << 1) // time
+#define COUNTEREN_IR (1L << 2) // instret
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -331,6 +345,10 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // accessed; set by the hardware
+#define PTE_D (1L << 7) // dirty: written since mapped; set by the hardware
+#define PTE_COW (1L << 8) // RSW bit: copy-on-write page, writable once copied
+#define PTE_GUARD (1L << 9) // RSW bit, in an invalid PTE: guard page, never filled
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -339,11 +357,20 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a valid PTE with any of R, W, X set is a leaf; otherwise
+// it points to the next level of the page table.
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// a leaf PTE at level 1 maps a 2-megabyte megapage.
+#define MEGASIZE (1L << PXSHIFT(1))
+#define MEGAORDER (PXSHIFT(1) - PGSHIFT) // kalloc_pages() order of a megapage
+#define MEGAROUNDDOWN(a) (((a)) & ~(MEGASIZE-1))
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
@@ -0,0 +1,168 @@
+//
+// Slab allocator: caches of equal-sized kernel objects, such
+// as processes, open files, in-memory inodes, pipes, buffers
+// and disk request headers, so that none of them needs a
+// fixed-size table or a whole page of its own.
+//
+// A cache hands out objects of one size, carved from whole
+// pages that it gets from kalloc() as it needs them. Each CPU
+// keeps a short list of free objects of its own, so most
+// kcachealloc() and kcachefree() calls take no lock at all;
+// a CPU moves KCPUBATCH objects at a time between its list and
+// the cache's shared list when its own runs empty or too long.
+//
+// A new object is zeroed. A recycled one holds whatever it
+// held when it was freed, except that its last 8 bytes, which
+// link the free list, are zero. Pages never go back to kalloc(),
+// so an object's memory is only ever reused for another object
+// of the same cache; proc.c depends on that.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+
+#define KCPUMAX 16    // free objects a CPU keeps on its own list
+#define KCPUBATCH 8   // objects moved to or from the shared list at once
+
+#define NEXT(c, o) (*(void**)((char*)(o) + (c)->size - sizeof(void*)))
+
+// every cache, for kcachestats(). caches are made at boot,
+// on one hart, and never destroyed, so the list needs no lock.
+static struct kcache *kcaches;
+
+void
+kcacheinit(struct kcache *c, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE)
+    panic("kcacheinit");
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->next = kcaches;
+  kcaches = c;
+}
+
+// Carve a new page into objects for c's shared free list.
+// Caller must hold c->lock.
+static int
+kcachegrow(struct kcache *c)
+{
+  char *pa, *o;
+
+  if((pa = kalloc_zeroed()) == 0)
+    return -1;
+  for(o = pa; o + c->size <= pa + PGSIZE; o += c->size){
+    NEXT(c, o) = c->free;
+    c->free = o;
+    c->nfree++;
+    c->nobj++;
+  }
+  c->npage++;
+  return 0;
+}
+
+// Move up to KCPUBATCH objects from c's shared list to CPU
+// id's list, growing the cache if the shared list is empty.
+// Returns -1 if it is empty and no memory is left.
+static int
+kcacherefill(struct kcache *c, int id)
+{
+  void *o;
+
+  acquire(&c->lock);
+  if(c->free == 0 && kcachegrow(c) < 0){
+    release(&c->lock);
+    return -1;
+  }
+  for(int i = 0; i < KCPUBATCH && c->free; i++){
+    o = c->free;
+    c->free = NEXT(c, o);
+    c->nfree--;
+    NEXT(c, o) = c->cpu[id].free;
+    c->cpu[id].free = o;
+    c->cpu[id].n++;
+  }
+  release(&c->lock);
+  return 0;
+}
+
+// Move KCPUBATCH objects from CPU id's list back to c's
+// shared list, for other CPUs to use.
+static void
+kcachedrain(struct kcache *c, int id)
+{
+  void *o;
+
+  acquire(&c->lock);
+  for(int i = 0; i < KCPUBATCH && c->cpu[id].free; i++){
+    o = c->cpu[id].free;
+    c->cpu[id].free = NEXT(c, o);
+    c->cpu[id].n--;
+    NEXT(c, o) = c->free;
+    c->free = o;
+    c->nfree++;
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kcachealloc(struct kcache *c)
+{
+  void *o;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->cpu[id].free == 0 && kcacherefill(c, id) < 0){
+    pop_off();
+    return 0;
+  }
+  o = c->cpu[id].free;
+  c->cpu[id].free = NEXT(c, o);
+  c->cpu[id].n--;
+  pop_off();
+
+  NEXT(c, o) = 0;
+  return o;
+}
+
+// Give object o back to c.
+void
+kcachefree(struct kcache *c, void *o)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  NEXT(c, o) = c->cpu[id].free;
+  c->cpu[id].free = o;
+  if(++c->cpu[id].n > KCPUMAX)
+    kcachedrain(c, id);
+  pop_off();
+}
+
+// Report each cache's object size, objects in use and on
+// free lists, and pages, for the statistics device.
+int
+kcachestats(char *buf, int sz)
+{
+  struct kcache *c;
+  int n = 0, nfree;
+
+  for(c = kcaches; c; c = c->next){
+    nfree = c->nfree;
+    for(int i = 0; i < NCPU; i++)
+      nfree += c->cpu[i].n;
+    n += snprintf(buf+n, sz-n, "slab %s: size %d inuse %d free %d pages %d\n",
+                  c->name, c->size, c->nobj - nfree, nfree, c->npage);
+  }
+  return n;
+}
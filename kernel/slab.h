@@ -0,0 +1,19 @@
+// A cache of equal-sized kernel objects; see slab.c.
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, a multiple of 8
+  void *free;           // free objects, linked through their last 8 bytes
+  int nfree;            // objects on free
+  int nobj;             // objects carved out of pages so far
+  int npage;            // pages taken from kalloc()
+
+  // each CPU's own free objects. only that CPU uses its
+  // list, with interrupts off, so they need no lock.
+  struct {
+    void *free;
+    int n;
+  } cpu[NCPU];
+
+  struct kcache *next;  // list of all caches, for kcachestats()
+};
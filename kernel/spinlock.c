@@ -14,6 +14,8 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->nts = 0;
+  lk->n = 0;
 }
 
 // Acquire the lock.
@@ -29,8 +31,9 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  __sync_fetch_and_add(&lk->n, 1);
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    __sync_fetch_and_add(&lk->nts, 1);
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -108,3 +111,12 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Format lk's contention counters into buf for the
+// statistics device. Returns the number of characters written.
+int
+statslock(struct spinlock *lk, char *buf, int sz)
+{
+  return snprintf(buf, sz, "lock: %s: #test-and-set %d #acquire() %d\n",
+                  lk->name, lk->nts, lk->n);
+}
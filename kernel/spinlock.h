@@ -5,5 +5,9 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For contention statistics:
+  int nts;           // Number of test-and-set spins while waiting.
+  int n;             // Number of acquires.
 };
 
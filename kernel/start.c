@@ -38,6 +38,11 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor and user mode read the cycle, time and
+  // instruction counters, for benchmarks like membench.
+  w_mcounteren(COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+  w_scounteren(COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -60,7 +65,7 @@ timerinit()
   int id = r_mhartid();
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
+  int interval = TICKCYCLES;
   *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
 
   // prepare information in scratch[] for timervec.
@@ -0,0 +1,106 @@
+//
+// the statistics device: reading it returns a text
+// snapshot of kernel performance counters.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+// a snapshot is at most this many bytes: 2^SNAPORDER pages.
+#define SNAPORDER 1
+#define SNAPSZ (PGSIZE << SNAPORDER)
+
+// each open file has its own snapshot, in f->priv, taken
+// by its first read and kept until a read returns end of
+// file, so that a reader that reads a piece at a time sees
+// one consistent report, whatever other readers do. f->off
+// is how much of it has been read. the lock serializes
+// readers that share a file.
+struct {
+  struct spinlock lock;
+} stats;
+
+// take a fresh snapshot of every subsystem's counters.
+static void
+statsfill(char *buf, int sz)
+{
+  char *msg = "stats: report truncated\n";
+  int n = 0;
+
+  n += kallocstats(buf+n, sz-n);
+  n += kcachestats(buf+n, sz-n);
+  n += schedstats(buf+n, sz-n);
+  n += timerstats(buf+n, sz-n);
+  n += bcachestats(buf+n, sz-n);
+  n += logstats(buf+n, sz-n);
+  n += virtiostats(buf+n, sz-n);
+  if(n >= sz-1){
+    // snprintf() stopped at the end of buf. say so,
+    // rather than end mid-line.
+    n = sz - 1 - strlen(msg);
+    safestrcpy(buf+n, msg, sz-n);
+  }
+}
+
+int
+statsread(struct file *f, int user_dst, uint64 dst, int n)
+{
+  char *snap;
+  int m;
+
+  acquire(&stats.lock);
+  if(f->priv == 0){
+    if((f->priv = kalloc_pages(SNAPORDER)) == 0){
+      release(&stats.lock);
+      return -1;
+    }
+    statsfill(f->priv, SNAPSZ);
+    f->off = 0;
+  }
+  snap = f->priv;
+  m = strlen(snap) - f->off;
+  if(m > n)
+    m = n;
+  if(m > 0 && either_copyout(user_dst, dst, snap+f->off, m) == -1){
+    release(&stats.lock);
+    return -1;
+  }
+  f->off += m;
+  if(m == 0){
+    // end of this snapshot; the next read takes a new one.
+    kfree_pages(f->priv, SNAPORDER);
+    f->priv = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// free a snapshot that wasn't read to the end.
+void
+statsclose(struct file *f)
+{
+  if(f->priv)
+    kfree_pages(f->priv, SNAPORDER);
+  f->priv = 0;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+  devsw[STATS].close = statsclose;
+}
@@ -1,13 +1,42 @@
 #include "types.h"
 
+// memset(), memcmp() and memmove() work a byte at a time
+// only up to an 8-byte boundary and for the last few
+// bytes; in between they use 64-bit words, four to a
+// loop iteration. memcmp() and memmove() need dst and
+// src to be equally aligned for that, as they are for
+// whole pages and blocks.
+
+#define WMASK (sizeof(uint64) - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64 w, *wd;
+
+  while(n > 0 && ((uint64)d & WMASK)){
+    *d++ = c;
+    n--;
+  }
+  if(n >= sizeof(uint64)){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64*)d;
+    for(; n >= 4*sizeof(uint64); n -= 4*sizeof(uint64), wd += 4){
+      wd[0] = w;
+      wd[1] = w;
+      wd[2] = w;
+      wd[3] = w;
+    }
+    for(; n >= sizeof(uint64); n -= sizeof(uint64))
+      *wd++ = w;
+    d = (uchar*)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -15,9 +44,25 @@ int
 memcmp(const void *v1, const void *v2, uint n)
 {
   const uchar *s1, *s2;
+  const uint64 *w1, *w2;
 
   s1 = v1;
   s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & WMASK) == 0){
+    while(n > 0 && ((uint64)s1 & WMASK)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    // skip equal words; the bytes below find where
+    // a differing one differs.
+    w1 = (const uint64*)s1;
+    w2 = (const uint64*)s2;
+    for(; n >= sizeof(uint64) && *w1 == *w2; n -= sizeof(uint64))
+      w1++, w2++;
+    s1 = (const uchar*)w1;
+    s2 = (const uchar*)w2;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,17 +77,63 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int aligned;
 
   s = src;
   d = dst;
+  aligned = (((uint64)s ^ (uint64)d) & WMASK) == 0;
   if(s < d && s + n > d){
+    // overlapping, with dst above src: copy backwards.
     s += n;
     d += n;
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 4*sizeof(uint64); n -= 4*sizeof(uint64)){
+        ws -= 4;
+        wd -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= sizeof(uint64); n -= sizeof(uint64))
+        *--wd = *--ws;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 4*sizeof(uint64); n -= 4*sizeof(uint64)){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+        ws += 4;
+        wd += 4;
+      }
+      for(; n >= sizeof(uint64); n -= sizeof(uint64))
+        *wd++ = *ws++;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -35,21 +36,41 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
+// Allocate a file descriptor for the given file: the lowest
+// one free, which is the lowest clear bit of p->fdmap.
 // Takes over file reference from caller on success.
 static int
 fdalloc(struct file *f)
 {
-  int fd;
+  int fd, b;
   struct proc *p = myproc();
+  uint64 free = ~p->fdmap;
 
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
-      return fd;
+  if(free == 0)
+    return -1;
+  // binary search for the lowest set bit of free.
+  fd = 0;
+  for(b = 32; b > 0; b >>= 1){
+    if((free & ((1ULL << b) - 1)) == 0){
+      free >>= b;
+      fd += b;
     }
   }
-  return -1;
+  if(fd >= NOFILE)
+    return -1;
+  p->ofile[fd] = f;
+  p->fdmap |= 1ULL << fd;
+  return fd;
+}
+
+// Release file descriptor fd, without closing its file.
+static void
+fdfree(int fd)
+{
+  struct proc *p = myproc();
+
+  p->ofile[fd] = 0;
+  p->fdmap &= ~(1ULL << fd);
 }
 
 uint64
@@ -75,6 +96,8 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  // the copy happens with an inode, pipe or device lock held.
+  vmaprefault(p, n);
   return fileread(f, p, n);
 }
 
@@ -87,7 +110,8 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
-
+  // the copy happens with an inode, pipe or device lock held.
+  vmaprefault(p, n);
   return filewrite(f, p, n);
 }
 
@@ -99,7 +123,7 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  fdfree(fd);
   fileclose(f);
   return 0;
 }
@@ -336,6 +360,7 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ranext = f->rawin = f->raend = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -469,18 +494,115 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0);
+    fdfree(fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// Map len bytes of the file open as fd, from offset off,
+// or of zeroes if flags has MAP_ANONYMOUS, at an address
+// of the kernel's choosing; the addr hint is ignored.
+// Pages are filled when first touched.
+uint64
+sys_mmap(void)
+{
+  uint64 len, va;
+  int prot, flags, off, perm;
+  struct file *f = 0;
+  struct inode *ip = 0;
+  uint filesz = 0;
+  struct proc *p = myproc();
+
+  if(argaddr(1, &len) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+     argint(5, &off) < 0)
+    return -1;
+  if(len == 0 || len > MAXUVA || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+
+  // RISC-V has no write-only pages.
+  perm = PTE_U;
+  if(prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    // stores to a private mapping never reach the file.
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ip = f->ip;
+    ilock(ip);
+    if(ip->type != T_FILE){
+      iunlock(ip);
+      return -1;
+    }
+    if(off < ip->size){
+      filesz = ip->size - off;
+      if(filesz > len)
+        filesz = len;
+    }
+    iunlock(ip);
+    idup(ip);
+  }
+
+  len = PGROUNDUP(len);
+  if((va = vmaplace(p->vma, len, p->sz)) == 0 ||
+     vmaadd(p->vma, va, va + len, ip, off, filesz, perm,
+            flags & (MAP_SHARED|MAP_PRIVATE)) < 0){
+    if(ip){
+      begin_op();
+      iput(ip);
+      end_op();
+    }
+    return -1;
+  }
+  return va;
+}
+
+// Unmap the mmap()ed pages in [addr, addr+len), writing
+// those of MAP_SHARED file mappings back to the file.
+// Pages in the range that aren't mapped are ignored.
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len, start, end;
+  struct vma *v;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len == 0 || addr >= MAXUVA || len > MAXUVA - addr)
+    return -1;
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    // program segments aren't mmap()ed.
+    if(v->used == 0 || v->flags == 0 || v->end <= addr || v->start >= addr + len)
+      continue;
+    start = addr > v->start ? addr : v->start;
+    end = addr + len < v->end ? addr + len : v->end;
+    if(vmaunmap(p->pagetable, p->vma, v, start, end) < 0)
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,238 @@
+//
+// Kernel timers, kept in a hierarchical timer wheel.
+//
+// Level 0 has a slot for each of the next TVSIZE ticks.
+// Each slot of level l covers TVSIZE^l ticks; when level 0
+// wraps around, the timers in the current slot of level 1
+// are spread over level 0, and so on up the levels. So each
+// tick looks only at timers that expire in it, and adding
+// or removing a timer is O(1), however many are pending.
+//
+// clockintr() calls timertick() on every tick. A timer's
+// function runs there, at interrupt time, with the timer
+// lock held: it must not sleep or call the other timer
+// functions. sleep(2) waits on a timer with timersleep().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "timer.h"
+#include "defs.h"
+
+#define TVBITS 6
+#define TVSIZE (1 << TVBITS)
+#define TVMASK (TVSIZE - 1)
+#define NLEVEL 4
+#define MAXDELAY ((1U << (NLEVEL*TVBITS)) - 1)
+
+struct {
+  struct spinlock lock;
+  uint now;      // next tick to run timers for
+  struct timer *wheel[NLEVEL][TVSIZE];
+  int npending;  // timers added and not yet run or deleted
+  int nfired;    // timers run
+} timers;
+
+void
+timersinit(void)
+{
+  initlock(&timers.lock, "timers");
+}
+
+// Put t in the slot for t->expires.
+// Caller must hold timers.lock.
+static void
+tinsert(struct timer *t)
+{
+  struct timer **slot;
+  uint e = t->expires;
+  uint d = e - timers.now;
+  int l;
+
+  if((int)d < 0){
+    // already due; run at the next tick.
+    slot = &timers.wheel[0][timers.now & TVMASK];
+  } else {
+    if(d > MAXDELAY){
+      // park it in the last level; it moves down
+      // as the wheel turns.
+      d = MAXDELAY;
+      e = timers.now + d;
+    }
+    for(l = 0; l < NLEVEL-1 && d >= (1U << ((l+1)*TVBITS)); l++)
+      ;
+    slot = &timers.wheel[l][(e >> (l*TVBITS)) & TVMASK];
+  }
+  t->next = *slot;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+// Take t out of its slot. Caller must hold timers.lock.
+static void
+tunlink(struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+static void
+tadd(struct timer *t, int n, void (*fn)(void*), void *arg)
+{
+  if(t->pending)
+    panic("timeradd");
+  // timers.now - 1 is the tick the wheel is up to.
+  t->expires = timers.now - 1 + n;
+  t->fn = fn;
+  t->arg = arg;
+  t->pending = 1;
+  timers.npending++;
+  tinsert(t);
+}
+
+// Arrange for fn(arg) to be called n ticks from now.
+// t must not be pending already.
+void
+timeradd(struct timer *t, int n, void (*fn)(void*), void *arg)
+{
+  acquire(&timers.lock);
+  tadd(t, n, fn, arg);
+  release(&timers.lock);
+}
+
+// Cancel t, if it hasn't run yet.
+// Returns 1 if it was pending, 0 if not.
+int
+timerdel(struct timer *t)
+{
+  int pending;
+
+  acquire(&timers.lock);
+  pending = t->pending;
+  if(pending){
+    tunlink(t);
+    t->pending = 0;
+    timers.npending--;
+  }
+  release(&timers.lock);
+  return pending;
+}
+
+// Sleep for n ticks.
+// Returns 0, or -1 if the process was killed first.
+int
+timersleep(int n)
+{
+  struct timer t;
+
+  if(n <= 0)
+    return 0;
+  t.pending = 0;
+  acquire(&timers.lock);
+  tadd(&t, n, wakeup, &t);
+  while(t.pending){
+    if(myproc()->killed){
+      tunlink(&t);
+      t.pending = 0;
+      timers.npending--;
+      release(&timers.lock);
+      return -1;
+    }
+    sleep(&t, &timers.lock);
+  }
+  release(&timers.lock);
+  return 0;
+}
+
+// Move the timers in slot idx of level l down the wheel.
+// Returns idx, which is 0 when level l has wrapped around
+// too. Caller must hold timers.lock.
+static int
+cascade(int l, int idx)
+{
+  struct timer *t, *next;
+
+  t = timers.wheel[l][idx];
+  timers.wheel[l][idx] = 0;
+  for(; t; t = next){
+    next = t->next;
+    tinsert(t);
+  }
+  return idx;
+}
+
+// Run the timers that are due, up to the current tick.
+// Called by clockintr() after it advances ticks.
+void
+timertick(void)
+{
+  struct timer *t;
+  int idx, l;
+
+  acquire(&timers.lock);
+  while((int)(ticks - timers.now) >= 0){
+    idx = timers.now & TVMASK;
+    if(idx == 0){
+      for(l = 1; l < NLEVEL; l++)
+        if(cascade(l, (timers.now >> (l*TVBITS)) & TVMASK) != 0)
+          break;
+    }
+    while((t = timers.wheel[0][idx]) != 0){
+      tunlink(t);
+      t->pending = 0;
+      timers.npending--;
+      timers.nfired++;
+      t->fn(t->arg);
+    }
+    timers.now++;
+  }
+  release(&timers.lock);
+}
+
+// Set *tick to the next tick at which timertick() has work
+// to do: a timer expiring, or the wheel moving timers down
+// from the upper levels, which may come before any expires.
+// Returns 0 if no timers are pending.
+int
+timernext(uint *tick)
+{
+  uint t, lap;
+  int found = 0;
+
+  acquire(&timers.lock);
+  if(timers.npending > 0){
+    found = 1;
+    // the next cascade: the first multiple of TVSIZE >= now.
+    lap = (timers.now + TVMASK) & ~TVMASK;
+    *tick = lap;
+    for(t = timers.now; t != lap; t++){
+      if(timers.wheel[0][t & TVMASK]){
+        *tick = t;
+        break;
+      }
+    }
+  }
+  release(&timers.lock);
+  return found;
+}
+
+// Report timer counts for the statistics device.
+int
+timerstats(char *buf, int sz)
+{
+  int n = 0;
+
+  n += statslock(&timers.lock, buf+n, sz-n);
+  n += snprintf(buf+n, sz-n, "timers: pending %d fired %d\n",
+                timers.npending, timers.nfired);
+  return n;
+}
@@ -0,0 +1,9 @@
+// A kernel timer; see timer.c.
+struct timer {
+  uint expires;           // tick at which to call fn
+  void (*fn)(void*);      // called at interrupt time
+  void *arg;
+  int pending;            // added and not yet run or deleted?
+  struct timer *next;     // wheel slot list
+  struct timer **pprev;
+};
@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char ucopyend[], ucopyfault[]; // ucopy.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -67,6 +68,18 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // instruction, load or store page fault. vmfault() may
+    // sleep reading a file, so allow interrupts once the
+    // trap registers have been read.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+    intr_on();
+    if(vmfault(p->pagetable, va, scause == 15) < 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      p->killed = 1;
+    }
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,8 +89,9 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt
+  // and the time slice is over.
+  if(which_dev == 2 && schedslice())
     yield();
 
   usertrapret();
@@ -137,20 +151,38 @@ kerneltrap()
   uint64 sepc = r_sepc();
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
+  uint64 stval = r_stval();
   
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // the code below doesn't touch user memory directly,
+  // and nor should anything it yields to.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) && stval < MAXUVA &&
+     sepc >= (uint64)ucopy && sepc < (uint64)ucopyend){
+    // a page fault on the user side of a direct copy to
+    // or from user memory: fill in the page and retry, or
+    // make the copy fail. a fault on the kernel side is a
+    // kernel bug, and panics below.
+    if(sstatus & SSTATUS_SPIE)
+      intr_on();
+    if(vmfault(myproc()->pagetable, stval, scause == 15) < 0)
+      sepc = (uint64)ucopyfault;
+    intr_off();
+    sfence_vma();
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this is a timer interrupt
+  // and the time slice is over.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && schedslice())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -159,13 +191,55 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Every hart's timer interrupt comes here. ticks counts
+// TICKCYCLES intervals of the CLINT's clock rather than
+// interrupts, so it stays right while some harts skip
+// ticks in tickless idle; whichever hart sees a new tick
+// first runs the timers.
 void
 clockintr()
 {
+  uint now = *(uint64*)KDEV(CLINT_MTIME) / TICKCYCLES;
+
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if((int)(now - ticks) <= 0){
+    // another hart already counted this tick.
+    release(&tickslock);
+    return;
+  }
+  ticks = now;
   release(&tickslock);
+  timertick();
+}
+
+// Tickless idle: a hart with nothing to run sets its timer
+// for the next timer wheel deadline, if any, instead of the
+// next tick. clockresume() restarts its periodic tick, and
+// clockkick() ends its idle early.
+// Interrupts must be off.
+void
+clockidle(void)
+{
+  uint next;
+  uint64 cmp = -1;  // never
+
+  if(timernext(&next))
+    cmp = (uint64)next * TICKCYCLES;
+  *(uint64*)KDEV(CLINT_MTIMECMP(cpuid())) = cmp;
+}
+
+void
+clockresume(void)
+{
+  *(uint64*)KDEV(CLINT_MTIMECMP(cpuid())) = *(uint64*)KDEV(CLINT_MTIME) + TICKCYCLES;
+}
+
+// Make hart id take a timer interrupt right away, to wake
+// it from wfi.
+void
+clockkick(int id)
+{
+  *(uint64*)KDEV(CLINT_MTIMECMP(id)) = *(uint64*)KDEV(CLINT_MTIME);
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -204,10 +278,8 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
+    clockintr();
+
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
@@ -11,9 +11,11 @@
 #include "defs.h"
 
 // the UART control registers are memory-mapped
-// at address UART0. this macro returns the
+// at address UART0, and at KDEV(UART0) once this
+// hart has turned on paging: harts print before
+// kvminithart(). this macro returns the
 // address of one of the registers.
-#define Reg(reg) ((volatile unsigned char *)(UART0 + reg))
+#define Reg(reg) ((volatile unsigned char *)((r_satp() ? KDEV(UART0) : UART0) + reg))
 
 // the UART control registers.
 // some have different meanings for
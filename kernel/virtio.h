@@ -43,9 +43,10 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; the queue uses as
+// many as the device allows, up to NUM.
 // must be a power of two.
-#define NUM 8
+#define NUM 1024
 
 struct VRingDesc {
   uint64 addr;
@@ -65,6 +66,14 @@ struct VRingUsedElem {
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
+// the first descriptor of each disk request points to one
+// of these, telling the device what to do.
+struct virtio_blk_req {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
 struct UsedArea {
   uint16 flags;
   uint16 id;
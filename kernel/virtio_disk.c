@@ -5,6 +5,12 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// The queue is as deep as the device allows (up to NUM
+// descriptors), and many requests can be outstanding at
+// once: virtio_disk_start() queues a request and returns,
+// and virtio_disk_intr() completes every request the device
+// has finished. virtio_disk_rw() is start followed by wait.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -16,35 +22,52 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "slab.h"
 
 // the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+#define R(r) ((volatile uint32 *)KDEV(VIRTIO0 + (r)))
+
+// bytes of queue memory for a legacy queue of n descriptors:
+// the descriptors and the avail ring, then the used ring
+// on the next page boundary.
+#define RINGSZ(n) \
+  (PGROUNDUP((n)*sizeof(struct VRingDesc) + (3+(n))*sizeof(uint16)) + \
+   PGROUNDUP(3*sizeof(uint16) + (n)*sizeof(struct VRingUsedElem)))
 
 static struct disk {
- // memory for virtio descriptors &c for queue 0.
- // this is a global instead of allocated because it must
- // be multiple contiguous pages, which kalloc()
- // doesn't support, and page aligned.
-  char pages[2*PGSIZE];
+  // memory for virtio descriptors &c for queue 0:
+  // RINGSZ(num) bytes of contiguous, page-aligned
+  // pages from kalloc_pages().
+  char *pages;
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
+  uint num;        // descriptors in the queue; a power of two <= NUM.
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 freelist[NUM]; // stack of free descriptor indices.
+  uint nfree;
+  uint16 used_idx; // we've looked this far in used->elems[].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    struct virtio_blk_req *req; // command header, from reqcache
     char status;
   } info[NUM];
-  
+
+  // statistics.
+  int nreq;        // requests submitted
+  int inflight;    // requests the device hasn't finished
+  int maxinflight; // high-water mark of inflight
+
   struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
+
+} disk;
+
+struct kcache reqcache;
 
 void
 virtio_disk_init(void)
@@ -52,6 +75,7 @@ virtio_disk_init(void)
   uint32 status = 0;
 
   initlock(&disk.vdisk_lock, "virtio_disk");
+  kcacheinit(&reqcache, "virtio_req", sizeof(struct virtio_blk_req));
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
@@ -59,7 +83,7 @@ virtio_disk_init(void)
      *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
     panic("could not find virtio disk");
   }
-  
+
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
   *R(VIRTIO_MMIO_STATUS) = status;
 
@@ -87,27 +111,38 @@ virtio_disk_init(void)
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
+  // initialize queue 0, as deep as the device allows.
   *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < 3)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num >>= 1;
+  int order = 0;
+  while((PGSIZE << order) < RINGSZ(disk.num))
+    order++;
+  if((disk.pages = kalloc_pages(order)) == 0)
+    panic("virtio disk ring");
+  memset(disk.pages, 0, PGSIZE << order);
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
+  *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = pages + num*16 -- 2 * uint16, then num * uint16
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem
 
   disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
+  disk.avail = (uint16*)(((char*)disk.desc) + disk.num*sizeof(struct VRingDesc));
+  disk.used = (struct UsedArea *)
+    PGROUNDUP((uint64)(disk.avail + 3 + disk.num));
 
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  disk.nfree = 0;
+  for(int i = disk.num - 1; i >= 0; i--)
+    disk.freelist[disk.nfree++] = i;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -116,26 +151,22 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
-      return i;
-    }
-  }
-  return -1;
+  if(disk.nfree == 0)
+    return -1;
+  return disk.freelist[--disk.nfree];
 }
 
 // mark a descriptor as free.
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("virtio_disk_intr 1");
-  if(disk.free[i])
+  if(disk.nfree >= disk.num)
     panic("virtio_disk_intr 2");
   disk.desc[i].addr = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.freelist[disk.nfree++] = i;
+  wakeup(&disk.freelist[0]);
 }
 
 // free a chain of descriptors.
@@ -143,9 +174,11 @@ static void
 free_chain(int i)
 {
   while(1){
+    int flag = disk.desc[i].flags;
+    int nxt = disk.desc[i].next;
     free_desc(i);
-    if(disk.desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk.desc[i].next;
+    if(flag & VRING_DESC_F_NEXT)
+      i = nxt;
     else
       break;
   }
@@ -154,21 +187,24 @@ free_chain(int i)
 static int
 alloc3_desc(int *idx)
 {
-  for(int i = 0; i < 3; i++){
+  if(disk.nfree < 3)
+    return -1;
+  for(int i = 0; i < 3; i++)
     idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
   return 0;
 }
 
+// Queue a read or write of b and return without waiting.
+// b->disk stays 1 until virtio_disk_intr() sees that the
+// device is done with b; see virtio_disk_wait().
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_start(struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
+  struct virtio_blk_req *buf0;
+
+  if((buf0 = kcachealloc(&reqcache)) == 0)
+    panic("virtio_disk_start");
 
   acquire(&disk.vdisk_lock);
 
@@ -182,29 +218,22 @@ virtio_disk_rw(struct buf *b, int write)
     if(alloc3_desc(idx) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&disk.freelist[0], &disk.vdisk_lock);
   }
-  
+
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
-
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  // buf0 is in a kalloc()ed page, which is direct mapped.
+  disk.desc[idx[0]].addr = (uint64) buf0;
+  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
@@ -217,7 +246,7 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
   disk.desc[idx[1]].next = idx[2];
 
-  disk.info[idx[0]].status = 0;
+  disk.info[idx[0]].status = 0xff; // device writes 0 on success
   disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
   disk.desc[idx[2]].len = 1;
   disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
@@ -226,45 +255,94 @@ virtio_disk_rw(struct buf *b, int write)
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].req = buf0;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  disk.avail[2 + (disk.avail[1] % disk.num)] = idx[0];
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
+  __sync_synchronize();
+
+  disk.nreq++;
+  if(++disk.inflight > disk.maxinflight)
+    disk.maxinflight = disk.inflight;
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the device to finish a request that
+// virtio_disk_start() queued for b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
   acquire(&disk.vdisk_lock);
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  // the device increments disk.used->id when it
+  // adds an entry to the used ring.
+
+  while(disk.used_idx != disk.used->id){
+    __sync_synchronize();
+    int id = disk.used->elems[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+    struct buf *b = disk.info[id].b;
+    disk.info[id].b = 0;
+    kcachefree(&reqcache, disk.info[id].req);
+    disk.info[id].req = 0;
+    free_chain(id);
+    disk.inflight--;
+
+    b->disk = 0;   // disk is done with buf
+    if(b->async)
+      breadahead_done(b); // nobody is waiting for it
+    else
+      wakeup(b);
+
+    disk.used_idx += 1;
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   release(&disk.vdisk_lock);
 }
+
+// Report queue depth and request counts for the
+// statistics device.
+int
+virtiostats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "virtio: queue %d requests %d inflight %d max inflight %d\n",
+                  disk.num, disk.nreq, disk.inflight, disk.maxinflight);
+}
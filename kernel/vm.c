@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -24,22 +26,27 @@ kvminit()
   kernel_pagetable = (pagetable_t) kalloc();
   memset(kernel_pagetable, 0, PGSIZE);
 
+  // the devices, above PHYSTOP; the addresses below
+  // KERNBASE are for user memory.
+
   // uart registers
-  kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(KDEV(UART0), UART0, PGSIZE, PTE_R | PTE_W);
 
   // virtio mmio disk interface
-  kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(KDEV(VIRTIO0), VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
   // CLINT
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  kvmmap(KDEV(CLINT), CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
-  kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kvmmap(KDEV(PLIC), PLIC, 0x400000, PTE_R | PTE_W);
 
   // map kernel text executable and read-only.
   kvmmap(KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages from the first 2-megabyte
+  // boundary after etext on.
   kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -57,8 +64,10 @@ kvminithart()
 }
 
 // Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// that corresponds to virtual address va at level *level.
+// If alloc!=0, create any required page-table pages.
+// If a leaf PTE higher up maps va, as for a megapage,
+// return that one instead, and set *level to its level.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -68,47 +77,127 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+// A leaf at level 1 maps a 2-megabyte megapage, and va's
+// level-0 index becomes part of the offset.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_pagetable()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
+}
+
+// Return the address of the PTE that maps va: the level-0
+// PTE, or a leaf above it. See walklevel().
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
 }
 
-// Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// Each process also has a kernel page table of its own,
+// which maps its user memory too, so that copyin() and
+// copyout() can use user addresses directly. It is a copy
+// of the top level of kernel_pagetable, sharing the levels
+// below, except that the entries for user memory, below
+// MAXUVA, point to the level-1 page-table pages of the
+// process's user page table. uvmkshare() allocates those
+// up front, so every later change to the user page table
+// shows up in the kernel page table as well.
+
+// Create a kernel page table for the process whose user page
+// table is pagetable. Returns 0 if out of memory.
+pagetable_t
+kvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpagetable;
+
+  if((kpagetable = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kvmsetuser(kpagetable, pagetable);
+  return kpagetable;
+}
+
+// Make kernel page table kpagetable map the user memory
+// of user page table pagetable, for exec().
+void
+kvmsetuser(pagetable_t kpagetable, pagetable_t pagetable)
+{
+  for(int i = 0; i < PX(2, MAXUVA); i++)
+    kpagetable[i] = pagetable[i];
+}
+
+void
+kvmfree(pagetable_t kpagetable)
+{
+  kfree((void*)kpagetable);
+}
+
+// Allocate the level-1 page-table pages for all of user
+// memory in pagetable, for kvmcreate() and kvmsetuser().
+// Returns 0 on success, -1 if out of memory; the caller
+// frees pagetable.
+int
+uvmkshare(pagetable_t pagetable)
+{
+  int level;
+
+  for(uint64 va = 0; va < MAXUVA; va += 1L << PXSHIFT(2)){
+    level = 1;
+    if(walklevel(pagetable, va, 1, &level) == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// The physical address of the page holding va, which the
+// leaf PTE pte at the given level maps.
+static uint64
+leafpa(pte_t pte, int level, uint64 va)
+{
+  uint64 off = va & ((1L << PXSHIFT(level)) - 1);
+
+  return PTE2PA(pte) + PGROUNDDOWN(off);
+}
+
+// Look up a virtual address, return the physical address
+// of its page, or 0 if not mapped.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  return leafpa(*pte, level, va);
 }
 
 // add a mapping to the kernel page table.
@@ -130,68 +219,117 @@ kvmpa(uint64 va)
 {
   uint64 off = va % PGSIZE;
   pte_t *pte;
-  uint64 pa;
+  int level = 0;
   
-  pte = walk(kernel_pagetable, va, 0);
+  pte = walklevel(kernel_pagetable, va, 0, &level);
   if(pte == 0)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
-  pa = PTE2PA(*pte);
-  return pa+off;
+  return leafpa(*pte, level, va) + off;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever both addresses are aligned to a
+// megapage and the range covers it all, map it with a single
+// level-1 leaf. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, step;
   pte_t *pte;
+  int level;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    level = 0;
+    step = PGSIZE;
+    if(a % MEGASIZE == 0 && pa % MEGASIZE == 0 && last - a >= MEGASIZE - PGSIZE){
+      level = 1;
+      step = MEGASIZE;
+    }
+    if((pte = walklevel(pagetable, a, 1, &level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a + step - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += step;
+    pa += step;
   }
   return 0;
 }
 
+// Replace the megapage leaf *pte with a page-table page of
+// 512 ordinary PTEs that map the same memory, and make the
+// megapage's physical pages separately freeable.
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmsplit(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte);
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  ksplit((void*)pa, MEGAORDER);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched, and so
+// were never mapped, are skipped. A megapage that is only
+// partly in the range is split first.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0){
+      *pte = 0;  // maybe a guard page.
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1){
+      if(a % MEGASIZE == 0 && a + MEGASIZE <= end){
+        if(do_free)
+          kfree_pages((void*)PTE2PA(*pte), MEGAORDER);
+        *pte = 0;
+        a += MEGASIZE - PGSIZE;
+        continue;
+      }
+      if(uvmsplit(pte) < 0)
+        panic("uvmunmap: split");
+      pte = walk(pagetable, a, 0);
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  // the process's kernel page table shares these PTEs.
+  sfence_vma();
 }
 
 // create an empty user page table.
@@ -200,10 +338,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_pagetable();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -236,12 +373,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -301,41 +437,199 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// The physical pages are shared, not copied:
+// writable pages become read-only copy-on-write
+// pages in both page tables, and cowcopy() gives
+// a process its own copy on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Copy the mappings of user addresses [start, end) from
+// old to new, as uvmcopy() does; or, if share is set, for
+// MAP_SHARED memory, map the same pages in new without
+// copy-on-write, so that stores by either are seen by both.
+// start must be page-aligned.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  int level;
+
+  for(i = start; i < end; i += PGSIZE){
+    // pages never touched since sbrk() stay unmapped
+    // in the child too.
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0){
+      if(*pte & PTE_GUARD){
+        if((pte = walk(new, i, 1)) == 0)
+          goto err;
+        *pte = PTE_GUARD;
+      }
+      continue;
+    }
+    if(level == 1){
+      // copy-on-write works a page at a time, so
+      // megapages are never shared: split it.
+      if(uvmsplit(pte) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    krefinc((void*)pa);
   }
+  // drop TLB entries for the pages that became read-only,
+  // which the parent's kernel page table shares.
+  sfence_vma();
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
+// Give the process a private, writable copy of the
+// copy-on-write page holding va, after a store to it.
+// If no other page table shares the page any more,
+// just make it writable again.
+// Returns 0 on success, -1 if va isn't a copy-on-write
+// user page or memory is exhausted.
+int
+cowcopy(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Map a zeroed megapage for the heap around va, if the
+// process's memory covers all of the aligned megapage, no
+// file-backed area overlaps it, and none of it is mapped.
+// Returns 0 if it did, -1 if not.
+static int
+megafault(struct proc *p, pagetable_t pagetable, uint64 va)
+{
+  uint64 a = MEGAROUNDDOWN(va);
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  if(a + MEGASIZE > p->sz || vmaoverlap(p->vma, a, a + MEGASIZE))
+    return -1;
+  pte = walklevel(pagetable, a, 0, &level);
+  if(pte && (*pte & PTE_V))
+    return -1;
+  // zeroed, without a junk fill first, and only if a block
+  // is ready: a kflush() would throw away the per-CPU lists
+  // and zeroed pages the 4K path wants.
+  if((mem = kalloc_pages_try(MEGAORDER)) == 0)
+    return -1;
+  if(mappages(pagetable, a, MEGASIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree_pages(mem, MEGAORDER);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a page fault at user virtual address va in the
+// current process, or a copyin()/copyout() that touches
+// an absent page: break copy-on-write sharing on a write,
+// fill in a not-yet-loaded page of a vma, such as a program
+// segment or an mmap()ed file, or map a zeroed page for
+// heap that sbrk() reserved but that was never touched.
+// Returns 0 if va is now mapped, -1 if the access is bad
+// or memory is exhausted.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return cowcopy(pagetable, va);
+    return -1;
+  }
+  if(pte && (*pte & PTE_GUARD))
+    return -1;
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+
+  if((v = vmalookup(p->vma, va)) != 0){
+    if(write && (v->perm & PTE_W) == 0)
+      return -1;
+    // reading the file may sleep, which isn't allowed while
+    // holding a spinlock. system calls that copy with a lock
+    // held call vmaprefault() first, so this is a bad address.
+    if(intr_get() == 0)
+      return -1;
+    return vmafill(pagetable, v, va);
+  }
+
+  if(va >= p->sz)
+    return -1;
+
+  // demand-zero heap, a megapage at a time where possible.
+  if(megafault(p, pagetable, va) == 0)
+    return 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// turn the page at va into a guard page: free it, and
+// leave an invalid PTE that vmfault() won't fill, so that
+// neither the process nor the kernel, which can reach
+// non-PTE_U pages in copyin() and copyout(), can use it.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
@@ -343,9 +637,23 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte_t *pte;
   
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(pte == 0 || (*pte & PTE_V) == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  kfree((void*)PTE2PA(*pte));
+  *pte = PTE_GUARD;
+}
+
+// Can the kernel use user addresses [va, va+len) of
+// pagetable directly? Only if pagetable belongs to the
+// current process, whose kernel page table is in use,
+// and the range is within user memory.
+static int
+uaccessok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && pagetable == p->pagetable &&
+         va < MAXUVA && len <= MAXUVA - va;
 }
 
 // Copy from kernel to user.
@@ -355,12 +663,32 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
+  int level;
+
+  // a store to an absent or copy-on-write page faults,
+  // and kerneltrap() calls vmfault().
+  if(uaccessok(pagetable, dstva, len))
+    return ucopy((char*)dstva, src, len);
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
       return -1;
+    // fault in an absent page, and break copy-on-write
+    // sharing, before the kernel stores into the page
+    // on the process's behalf.
+    level = 0;
+    pte = walklevel(pagetable, va0, 0, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_COW)){
+      if(vmfault(pagetable, va0, 1) < 0)
+        return -1;
+      level = 0;
+      pte = walklevel(pagetable, va0, 0, &level);
+    }
+    if((*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W))
+      return -1;
+    pa0 = leafpa(*pte, level, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -381,11 +709,17 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uaccessok(pagetable, srcva, len))
+    return ucopy(dst, (char*)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -408,11 +742,20 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(uaccessok(pagetable, srcva, 1)){
+    if(max > MAXUVA - srcva)
+      max = MAXUVA - srcva;
+    return ucopystr(dst, (char*)srcva, max);
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
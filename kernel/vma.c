@@ -0,0 +1,365 @@
+//
+// Virtual memory areas: ranges of a process's user memory
+// whose pages are filled from a file, or zeroed, the first
+// time they are touched, instead of when the range is set up.
+// exec() uses them to demand-page program segments, and
+// mmap() for file and anonymous mappings, which it places
+// top-down from MAXUVA, above the heap.
+//
+// fork() shares the pages of a MAP_SHARED mapping with the
+// child, and munmap() and exit() write its dirty pages back
+// to the file. MAP_PRIVATE pages are copy-on-write after
+// fork(), and never written back. There is no page cache:
+// processes that map a file independently each read their
+// own copies of its pages, which meet only in the file.
+//
+// So a file mapping is no cheaper than read(): vmafill()
+// copies each page once from the buffer cache, whose
+// BSIZE-byte blocks are smaller than a page and not
+// contiguous, so they can't be mapped themselves.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+// Find an unused slot in vma[], or 0.
+static struct vma*
+vmaslot(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->used == 0)
+      return v;
+  return 0;
+}
+
+// Record that user addresses [start, end) are backed by
+// ip starting at file offset off, for filesz bytes; the
+// rest of the range reads as zeroes. ip is 0 for an
+// anonymous area. flags are mmap()'s MAP_SHARED or
+// MAP_PRIVATE, or 0 for a program segment.
+// start must be page-aligned.
+// Takes over the caller's reference to ip.
+// Returns 0 on success, -1 if vma[] is full.
+int
+vmaadd(struct vma *vma, uint64 start, uint64 end, struct inode *ip,
+       uint off, uint filesz, int perm, int flags)
+{
+  struct vma *v;
+
+  if(start % PGSIZE)
+    panic("vmaadd: not aligned");
+  if((v = vmaslot(vma)) == 0)
+    return -1;
+  v->used = 1;
+  v->start = start;
+  v->end = end;
+  v->ip = ip;
+  v->off = off;
+  v->filesz = filesz;
+  v->perm = perm;
+  v->flags = flags;
+  return 0;
+}
+
+// Find the area containing user address va, or 0.
+struct vma*
+vmalookup(struct vma *vma, uint64 va)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->used && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Find an area that overlaps user addresses [start, end), or 0.
+struct vma*
+vmaoverlap(struct vma *vma, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->used && start < v->end && v->start < end)
+      return v;
+  return 0;
+}
+
+// Drop every area and its file reference.
+// Must not be called inside a transaction.
+void
+vmaclear(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->used){
+      if(v->ip){
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      v->used = 0;
+      v->ip = 0;
+    }
+  }
+}
+
+// Give np copies of p's areas, for fork().
+void
+vmadup(struct vma *nvma, struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    nvma[i] = vma[i];
+    if(vma[i].used && vma[i].ip)
+      idup(vma[i].ip);
+  }
+}
+
+// Map the page of area v holding va into pagetable,
+// reading its contents from the file through the buffer
+// cache. May sleep.
+// Returns 0 on success, -1 on failure.
+int
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  char *mem;
+  uint64 pgoff;
+  uint n;
+
+  va = PGROUNDDOWN(va);
+  pgoff = va - v->start;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(pgoff < v->filesz){
+    n = v->filesz - pgoff;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(v->ip);
+    if(readi(v->ip, 0, (uint64)mem, v->off + pgoff, n) != n){
+      iunlock(v->ip);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(v->ip);
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, v->perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in any not-yet-filled pages of areas in the
+// user range [va, va+n) of the current process.
+// System calls call this before taking locks they hold
+// across copyin()/copyout(), since filling a page may
+// sleep and may need an inode lock the caller holds.
+void
+vmaprefault(uint64 va, int n)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, start, end;
+
+  if(n <= 0 || va >= MAXUVA)
+    return;
+  end = va + n;
+  if(end > MAXUVA)
+    end = MAXUVA;
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->used == 0 || v->end <= va || v->start >= end)
+      continue;
+    start = va > v->start ? PGROUNDDOWN(va) : v->start;
+    for(a = start; a < end && a < v->end; a += PGSIZE){
+      if(walkaddr(p->pagetable, a) == 0)
+        vmfault(p->pagetable, a, 0);
+    }
+  }
+}
+
+// Find room for an mmap() of len bytes, page-aligned: the
+// highest free range below MAXUVA that is above the heap,
+// which ends at sz. Returns its start, or 0 if there is none.
+uint64
+vmaplace(struct vma *vma, uint64 len, uint64 sz)
+{
+  struct vma *v;
+  uint64 end = MAXUVA;
+
+  while(end >= len && end - len >= PGROUNDUP(sz)){
+    if((v = vmaoverlap(vma, end - len, end)) == 0)
+      return end - len;
+    end = v->start;
+  }
+  return 0;
+}
+
+// Bytes of file data in area v from user address a on.
+static uint
+vmafilesz(struct vma *v, uint64 a)
+{
+  if(v->filesz <= a - v->start)
+    return 0;
+  return v->filesz - (a - v->start);
+}
+
+// Write the pages of area v in [start, end) that the
+// process has stored to back to the file, if v is a
+// writable MAP_SHARED file mapping. Writes no further
+// than the file's end, so a mapping never grows its file.
+// Must not be called inside a transaction.
+static void
+vmawriteback(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  // as in filewrite(), a few blocks per transaction.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, pa;
+  uint off, n;
+  pte_t *pte;
+
+  if(v->ip == 0 || (v->flags & MAP_SHARED) == 0 || (v->perm & PTE_W) == 0)
+    return;
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->start);
+    for(int i = 0; i < PGSIZE; i += max){
+      begin_op();
+      ilock(v->ip);
+      n = 0;
+      if(off + i < v->ip->size){
+        n = v->ip->size - (off + i);
+        if(n > PGSIZE - i)
+          n = PGSIZE - i;
+        if(n > max)
+          n = max;
+        if(writei(v->ip, 0, pa + i, off + i, n) != n)
+          n = 0;
+      }
+      iunlock(v->ip);
+      end_op();
+      if(n == 0)
+        break;
+    }
+  }
+}
+
+// Remove user addresses [start, end), page-aligned and
+// within area v, from the process: write its dirty
+// MAP_SHARED pages back, free its pages, and shrink or
+// split v to what remains.
+// Must not be called inside a transaction.
+// Returns 0, or -1, having done nothing, if v must be
+// split and vma[] is full.
+int
+vmaunmap(pagetable_t pagetable, struct vma *vma, struct vma *v,
+         uint64 start, uint64 end)
+{
+  struct vma *tail = 0;
+
+  if(start % PGSIZE || end % PGSIZE || start < v->start || end > v->end)
+    panic("vmaunmap");
+  if(start > v->start && end < v->end){
+    // a hole in the middle; the part above it needs a slot.
+    if((tail = vmaslot(vma)) == 0)
+      return -1;
+    *tail = *v;
+    tail->start = end;
+    tail->off = v->off + (end - v->start);
+    tail->filesz = vmafilesz(v, end);
+    if(tail->ip)
+      idup(tail->ip);
+  }
+
+  vmawriteback(pagetable, v, start, end);
+  uvmunmap(pagetable, start, (end - start) / PGSIZE, 1);
+
+  if(start == v->start && end == v->end){
+    if(v->ip){
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    v->used = 0;
+    v->ip = 0;
+  } else if(start == v->start){
+    v->filesz = vmafilesz(v, end);
+    v->off += end - v->start;
+    v->start = end;
+  } else {
+    if(v->filesz > start - v->start)
+      v->filesz = start - v->start;
+    v->end = start;
+  }
+  return 0;
+}
+
+// Remove every mmap() area from the process, for exit()
+// and exec(). Must not be called inside a transaction.
+void
+vmaunmapall(pagetable_t pagetable, struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->used && v->flags)
+      vmaunmap(pagetable, vma, v, v->start, v->end);
+}
+
+// Fill every page of the process's MAP_SHARED areas, so
+// that fork() can share them all with the child; a page
+// that each filled later would be two pages. May sleep.
+// Returns 0, or -1 if out of memory.
+int
+vmapopulate(pagetable_t pagetable, struct vma *vma)
+{
+  struct vma *v;
+  uint64 a;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->used == 0 || (v->flags & MAP_SHARED) == 0)
+      continue;
+    for(a = v->start; a < v->end; a += PGSIZE)
+      if(walkaddr(pagetable, a) == 0 && vmafill(pagetable, v, a) < 0)
+        return -1;
+  }
+  return 0;
+}
+
+// Map the pages of the mmap() areas in vma into a child's
+// page table new, for fork(): the same pages for a
+// MAP_SHARED area, copy-on-write ones for MAP_PRIVATE.
+// vmadup() copies the areas themselves.
+// Returns 0, or -1 with nothing mapped if out of memory.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *vma)
+{
+  struct vma *v, *u;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->used == 0 || v->flags == 0)
+      continue;
+    if(uvmcopyrange(old, new, v->start, v->end, v->flags & MAP_SHARED) < 0){
+      for(u = vma; u < v; u++)
+        if(u->used && u->flags)
+          uvmunmap(new, u->start, (u->end - u->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -83,6 +83,8 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  // the log header block lists the logged block numbers.
+  assert((nlog + 1) * sizeof(uint) <= BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -0,0 +1,115 @@
+// latency: measure interactive response under CPU load.
+// An echo process, standing in for a shell answering
+// keystrokes, bounces a byte back through a pair of pipes;
+// count the round trips it manages in a fixed time, first
+// on an idle machine and then with CPU-bound processes
+// running in the background.
+//
+// usage: latency [nhog [nticks]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAXHOG 32
+
+void
+hog(void)
+{
+  volatile uint64 x = 0;
+
+  for(;;)
+    x++;
+}
+
+// Run round trips through an echo child for nticks ticks.
+// Returns how many completed.
+int
+echotrips(int nticks)
+{
+  int to[2], from[2], pid, n, start;
+  char c = 'x';
+
+  if(pipe(to) < 0 || pipe(from) < 0){
+    fprintf(2, "latency: pipe failed\n");
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    fprintf(2, "latency: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+  n = 0;
+  start = uptime();
+  while(uptime() - start < nticks){
+    if(write(to[1], &c, 1) != 1 || read(from[0], &c, 1) != 1){
+      fprintf(2, "latency: echo failed\n");
+      exit(1);
+    }
+    n++;
+  }
+  close(to[1]);
+  close(from[0]);
+  wait(0);
+  return n;
+}
+
+void
+report(char *what, int n, int nticks)
+{
+  printf("%s: %d round trips in %d ticks", what, n, nticks);
+  // a tick is about 100ms in qemu.
+  if(n > 0)
+    printf(", about %d us each", nticks * 100000 / n);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pids[MAXHOG];
+  int nhog = 4, nticks = 20;
+  int i, n;
+
+  if(argc > 1)
+    nhog = atoi(argv[1]);
+  if(argc > 2)
+    nticks = atoi(argv[2]);
+  if(nhog < 0 || nhog > MAXHOG || nticks <= 0){
+    fprintf(2, "usage: latency [nhog (<= %d) [nticks]]\n", MAXHOG);
+    exit(1);
+  }
+
+  n = echotrips(nticks);
+  report("idle", n, nticks);
+
+  for(i = 0; i < nhog; i++){
+    if((pids[i] = fork()) < 0){
+      fprintf(2, "latency: fork failed\n");
+      nhog = i;
+      break;
+    }
+    if(pids[i] == 0)
+      hog();
+  }
+  // let the hogs use up their first time slices.
+  sleep(5);
+
+  n = echotrips(nticks);
+  printf("%d hogs ", nhog);
+  report("loaded", n, nticks);
+
+  for(i = 0; i < nhog; i++)
+    kill(pids[i]);
+  for(i = 0; i < nhog; i++)
+    wait(0);
+  exit(0);
+}
@@ -0,0 +1,156 @@
+// membench: measure memset(), memmove() and memcmp() in
+// bytes per cycle, against the byte-at-a-time loops they
+// replaced, for a few sizes, with aligned and unaligned
+// buffers. The kernel's versions in kernel/string.c are
+// the same code as ulib.c's.
+//
+// usage: membench [total-bytes-per-test]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAXSZ (64*1024)
+
+char bufa[MAXSZ + 16];
+char bufb[MAXSZ + 16];
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+// the byte-at-a-time versions, as a baseline.
+
+void*
+bytemove(void *vdst, const void *vsrc, int n)
+{
+  char *dst = vdst;
+  const char *src = vsrc;
+
+  while(n-- > 0)
+    *dst++ = *src++;
+  return vdst;
+}
+
+void*
+byteset(void *dst, int c, uint n)
+{
+  char *cdst = dst;
+
+  for(int i = 0; i < n; i++)
+    cdst[i] = c;
+  return dst;
+}
+
+int
+bytecmp(const void *s1, const void *s2, uint n)
+{
+  const char *p1 = s1, *p2 = s2;
+
+  while(n-- > 0){
+    if(*p1 != *p2)
+      return *p1 - *p2;
+    p1++;
+    p2++;
+  }
+  return 0;
+}
+
+enum { MOVE, SET, CMP };
+
+// Run test t on sz-byte buffers, at offset off from
+// 8-byte alignment for the source, until total bytes
+// are done. Returns the cycles taken.
+uint64
+run(int t, int fast, int sz, int off, int total)
+{
+  char *dst = bufa, *src = bufb + off;
+  uint64 start;
+  int i, n;
+
+  n = total / sz;
+  if(n == 0)
+    n = 1;
+  start = rdcycle();
+  for(i = 0; i < n; i++){
+    switch(t){
+    case MOVE:
+      if(fast)
+        memmove(dst, src, sz);
+      else
+        bytemove(dst, src, sz);
+      break;
+    case SET:
+      if(fast)
+        memset(dst + off, i, sz);
+      else
+        byteset(dst + off, i, sz);
+      break;
+    case CMP:
+      // equal buffers, so the whole length is compared.
+      if((fast ? memcmp(dst + off, src, sz) : bytecmp(dst + off, src, sz)) != 0){
+        fprintf(2, "membench: memcmp wrong\n");
+        exit(1);
+      }
+      break;
+    }
+  }
+  return rdcycle() - start;
+}
+
+// Print bytes per cycle with two decimals.
+void
+bpc(int bytes, uint64 cycles)
+{
+  uint64 x;
+
+  if(cycles == 0)
+    cycles = 1;
+  x = (uint64)bytes * 100 / cycles;
+  printf(" %d.%d%d", (int)(x / 100), (int)(x / 10 % 10), (int)(x % 10));
+}
+
+int
+main(int argc, char *argv[])
+{
+  static char *names[] = { "memmove", "memset", "memcmp" };
+  static int sizes[] = { 64, 512, 4096, MAXSZ };
+  int total = 4*1024*1024;
+  int t, s, off, sz, n;
+  uint64 slow, fast;
+
+  if(argc > 1)
+    total = atoi(argv[1]);
+  if(total <= 0){
+    fprintf(2, "usage: membench [total-bytes-per-test]\n");
+    exit(1);
+  }
+
+  printf("bytes per cycle: byte loop, word loop\n");
+  for(t = MOVE; t <= CMP; t++){
+    for(off = 0; off < 2; off++){
+      printf("%s %s:", names[t], off ? "unaligned" : "aligned");
+      for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+        sz = sizes[s];
+        n = total / sz;
+        if(n == 0)
+          n = 1;
+        if(t == CMP){
+          memset(bufa, 'x', sizeof(bufa));
+          memset(bufb, 'x', sizeof(bufb));
+        }
+        slow = run(t, 0, sz, off, total);
+        fast = run(t, 1, sz, off, total);
+        printf("  %d:", sz);
+        bpc(n * sz, slow);
+        bpc(n * sz, fast);
+      }
+      printf("\n");
+    }
+  }
+  exit(0);
+}
@@ -32,14 +32,41 @@ strlen(const char *s)
   return n;
 }
 
+// memset(), memmove() and memcmp() use 64-bit words,
+// four to a loop iteration, between the unaligned bytes
+// at either end; see kernel/string.c.
+
+#define WSIZE ((int)sizeof(uint64))
+#define WMASK (WSIZE - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64 w, *wd;
+
+  while(n > 0 && ((uint64)d & WMASK)){
+    *d++ = c;
+    n--;
+  }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64*)d;
+    for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4){
+      wd[0] = w;
+      wd[1] = w;
+      wd[2] = w;
+      wd[3] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar*)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -100,15 +127,59 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  uint64 *wd;
+  const uint64 *ws;
+  int aligned;
 
   dst = vdst;
   src = vsrc;
+  aligned = (((uint64)src ^ (uint64)dst) & WMASK) == 0;
   if (src > dst) {
+    if(aligned){
+      while(n > 0 && ((uint64)dst & WMASK)){
+        *dst++ = *src++;
+        n--;
+      }
+      wd = (uint64*)dst;
+      ws = (const uint64*)src;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+        wd += 4;
+        ws += 4;
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      dst = (char*)wd;
+      src = (const char*)ws;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(aligned){
+      while(n > 0 && ((uint64)dst & WMASK)){
+        *--dst = *--src;
+        n--;
+      }
+      wd = (uint64*)dst;
+      ws = (const uint64*)src;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        wd -= 4;
+        ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      dst = (char*)wd;
+      src = (const char*)ws;
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -119,6 +190,28 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+  const uint64 *w1, *w2;
+
+  if((((uint64)p1 ^ (uint64)p2) & WMASK) == 0){
+    while(n > 0 && ((uint64)p1 & WMASK)){
+      if (*p1 != *p2) {
+        return *p1 - *p2;
+      }
+      p1++;
+      p2++;
+      n--;
+    }
+    // skip equal words; the bytes below find the
+    // difference in an unequal one.
+    w1 = (const uint64*)p1;
+    w2 = (const uint64*)p2;
+    for(; n >= WSIZE && *w1 == *w2; n -= WSIZE){
+      w1++;
+      w2++;
+    }
+    p1 = (const char*)w1;
+    p2 = (const char*)w2;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
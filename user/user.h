@@ -23,6 +23,8 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
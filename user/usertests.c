@@ -735,6 +735,58 @@ pipe1(char *s)
   }
 }
 
+// push many times the pipe buffer through a pipe in
+// odd-sized writes and reads, so that copies start and
+// end at every offset in the ring.
+void
+pipebig(char *s)
+{
+  int fds[2], pid, xstatus;
+  int seq, i, n, total;
+  enum { N=20, WSZ=5003, RSZ=3001 };
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  seq = 0;
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < N; n++){
+      for(i = 0; i < WSZ; i++)
+        buf[i] = seq++;
+      if(write(fds[1], buf, WSZ) != WSZ){
+        printf("%s: short write\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf, RSZ)) > 0){
+    for(i = 0; i < n; i++){
+      if((buf[i] & 0xff) != (seq++ & 0xff)){
+        printf("%s: wrong byte at %d\n", s, total + i);
+        exit(1);
+      }
+    }
+    total += n;
+  }
+  close(fds[0]);
+  if(total != N * WSZ){
+    printf("%s: read %d bytes, expected %d\n", s, total, N * WSZ);
+    exit(1);
+  }
+  wait(&xstatus);
+  exit(xstatus);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -944,6 +996,71 @@ forkforkfork(char *s)
   sleep(10); // one second
 }
 
+// fork a process with more memory than could be copied;
+// parent and child must share pages copy-on-write, and
+// each must see only its own stores, including stores
+// the kernel makes with copyout().
+void
+cowfork(char *s)
+{
+  enum { SZ = 64*1024*1024 };  // over half of physical memory
+  char *p, *q;
+  int pid, ppid, xstatus, fds[2];
+
+  ppid = getpid();
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + SZ; q += PGSIZE)
+    *(int*)q = ppid;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    for(q = p; q < p + SZ; q += PGSIZE){
+      if(*(int*)q != ppid){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    for(q = p; q < p + SZ; q += 64*PGSIZE)
+      *(int*)q = getpid();
+    // let the kernel store into a shared page.
+    if(read(fds[0], p + PGSIZE, sizeof(int)) != sizeof(int)){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  close(fds[0]);
+  if(write(fds[1], &pid, sizeof(int)) != sizeof(int)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(q = p; q < p + SZ; q += PGSIZE){
+    if(*(int*)q != ppid){
+      printf("%s: parent sees child's store\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
 // regression test. does reparent() violate the parent-then-child
 // locking order when giving away a child to init, so that exit()
 // deadlocks against init's wait()? also used to trigger a "panic:
@@ -1880,9 +1997,13 @@ dirfile(char *s)
 void
 iref(char *s)
 {
+  // there's no fixed inode table for leaked references to
+  // run out of any more; N exceeds the NICACHE unreferenced
+  // inodes the kernel keeps, so iput() also recycles some.
+  enum { N = NICACHE + 1 };
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1904,7 +2025,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2076,6 +2197,123 @@ sbrkmuch(char *s)
   }
 }
 
+// fill a heap big enough for megapages, then check that fork,
+// the child's stores, and shrinking into the middle of a
+// megapage all leave the right data behind.
+void
+sbrkmega(char *s)
+{
+  enum { SZ = 6*1024*1024, CUT = 3*1024*1024 + 3*4096 };
+  char *a, *p, *cut;
+  int pid, xstatus;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += 4096)
+    *p = (uint64)p / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + SZ; p += 4096){
+      if(*p != (char)((uint64)p / 4096)){
+        printf("%s: child read wrong value\n", s);
+        exit(1);
+      }
+      *p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  for(p = a; p < a + SZ; p += 4096){
+    if(*p != (char)((uint64)p / 4096)){
+      printf("%s: child's store leaked into parent\n", s);
+      exit(1);
+    }
+  }
+
+  // shrink and grow back: the part cut off reads as zeroes.
+  cut = a + SZ - CUT;
+  sbrk(-CUT);
+  sbrk(CUT);
+  for(p = a; p < a + SZ; p += 4096){
+    if(*p != (p < cut ? (char)((uint64)p / 4096) : 0)){
+      printf("%s: wrong value after shrink\n", s);
+      exit(1);
+    }
+  }
+}
+
+// sbrk() only reserves address space; pages appear on
+// first touch, including touches by the kernel through
+// read() and write(), and survive fork().
+void
+sbrklazy(char *s)
+{
+  enum { BIG=512*1024*1024 };  // more than physical memory
+  char *a, *p;
+  int pid, xstatus, fds[2];
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 16*1024*1024)
+    *p = 1;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  // write() from an untouched page should send zeroes,
+  // and read() into an untouched page should fill it.
+  if(write(fds[1], a + BIG - 2*PGSIZE, 2) != 2 ||
+     read(fds[0], a + BIG - 8*PGSIZE, 2) != 2){
+    printf("%s: pipe i/o on lazy pages failed\n", s);
+    exit(1);
+  }
+  if(a[BIG - 8*PGSIZE] != 0 || a[BIG - 8*PGSIZE + 1] != 0){
+    printf("%s: lazy page not zero\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 16*1024*1024){
+      if(*p != 1){
+        printf("%s: child lost a page\n", s);
+        exit(1);
+      }
+    }
+    a[PGSIZE] = 2;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  if(sbrk(-BIG) != a + BIG){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2364,6 +2602,185 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// the kernel copies to and from user memory directly, but
+// must still refuse the stack guard page.
+void
+stackguardcopy(char *s)
+{
+  int fds[2];
+  char *guard = (char *) ((r_sp() & ~(PGSIZE-1)) - PGSIZE);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], guard, 1) != -1){
+    printf("%s: read into guard page succeeded\n", s);
+    exit(1);
+  }
+  if(write(fds[1], guard, 1) != -1){
+    printf("%s: write from guard page succeeded\n", s);
+    exit(1);
+  }
+  if(open(guard, O_RDONLY) != -1){
+    printf("%s: open of guard page name succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// mmap() a file: a private mapping reads the file but doesn't
+// change it, a shared one writes it back at munmap(), and
+// munmap() of part of a mapping leaves the rest.
+void
+mmapfile(char *s)
+{
+  char *f = "mmapfile.dat";
+  char *p, *q;
+  int fd, i, xstatus;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE + 100; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, 2*PGSIZE + 100) != 2*PGSIZE + 100){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 2*PGSIZE + 100, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE + 100; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: mmap private read wrong\n", s);
+      exit(1);
+    }
+  }
+  // the rest of the last page reads as zeroes.
+  if(p[3*PGSIZE - 1] != 0){
+    printf("%s: mmap past end of file not zero\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, 2*PGSIZE + 100) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 2*PGSIZE + 100, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  p[2*PGSIZE + 99] = 'Z';
+  // unmap the first page; the rest must stay.
+  if(munmap(p, PGSIZE) < 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  q = p + 2*PGSIZE;
+  if(q[0] != 'a' + (2*PGSIZE) % 26){
+    printf("%s: mapping gone after partial munmap\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus == 0){
+    printf("%s: store to unmapped page succeeded\n", s);
+    exit(1);
+  }
+  if(munmap(p + PGSIZE, 2*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, BUFSZ) != 2*PGSIZE + 100 ||
+     buf[1] != 'Y' || buf[2*PGSIZE + 99] != 'Z'){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
+// anonymous mmap(): MAP_SHARED memory is the same in parent
+// and child after fork(); MAP_PRIVATE memory is copied.
+void
+mmapanon(char *s)
+{
+  char *sh, *pr;
+  int pid, xstatus;
+
+  sh = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  pr = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(sh == (char*)-1 || pr == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  if(sh[0] != 0 || pr[0] != 0){
+    printf("%s: anonymous memory not zero\n", s);
+    exit(1);
+  }
+  pr[0] = 'p';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sh[PGSIZE] = 'c';
+    pr[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(sh[PGSIZE] != 'c'){
+    printf("%s: shared store not seen by parent\n", s);
+    exit(1);
+  }
+  if(pr[0] != 'p'){
+    printf("%s: private store seen by parent\n", s);
+    exit(1);
+  }
+  if(munmap(sh, 2*PGSIZE) < 0 || munmap(pr, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2656,6 +3073,7 @@ main(int argc, char *argv[])
     {twochildren, "twochildren"},
     {forkfork, "forkfork"},
     {forkforkfork, "forkforkfork"},
+    {cowfork, "cowfork"},
     {argptest, "argptest"},
     {createdelete, "createdelete"},
     {linkunlink, "linkunlink"},
@@ -2671,11 +3089,16 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {sbrkmega, "sbrkmega"},
+    {sbrklazy, "sbrklazy"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackguardcopy, "stackguardcopy"},
+    {mmapfile, "mmapfile"},
+    {mmapanon, "mmapanon"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
@@ -2685,6 +3108,7 @@ main(int argc, char *argv[])
     {iputtest, "iput"},
     {mem, "mem"},
     {pipe1, "pipe1"},
+    {pipebig, "pipebig"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},